@@ -46,4 +46,8 @@ namespace WebErrors
     SocketException::SocketException(const std::string &message)
         : BaseException(message) { }
 
+    /* A request body found to be over client_max_body_size while it was being read */
+    BodyTooLargeException::BodyTooLargeException(const std::string &message)
+        : BaseException(message) { }
+
 }
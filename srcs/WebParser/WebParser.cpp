@@ -1,5 +1,7 @@
 #include "WebParser.hpp"
 #include "WebErrors.hpp"
+#include <algorithm>
+#include <sys/resource.h>
 
 WebParser::WebParser(const std::string &filename) 
 :  _filename(filename), _file(filename)
@@ -42,7 +44,9 @@ bool WebParser::parse()
     if (!_bracePairCheckStack.empty())
         throw WebErrors::ConfigFormatException("Error: unclosed braces");
     _file.close();
+    parseUpstreams();
     parseServer();
+    extractGlobalInfo();
     return true;
 }
 
@@ -51,6 +55,11 @@ const std::vector<Server> &WebParser::getServers(void) const
     return (_servers);
 }
 
+const std::vector<Upstream> &WebParser::getUpstreams(void) const
+{
+    return (_upstreams);
+}
+
 //Can we remove this + parseCGIPass now?
 void WebParser::parseProxyPass(const std::string &line)
 {
@@ -74,6 +83,31 @@ void WebParser::parseCgiPass(const std::string &line)
 
 const std::string &WebParser::getProxyPass() const { return _proxyPass; }
 
+int WebParser::getWorkerThreads() const { return _workerThreads; }
+
+bool WebParser::getWorkerCpuAffinity() const { return _workerCpuAffinity; }
+
+bool WebParser::getEdgeTriggered() const { return _edgeTriggered; }
+
+size_t WebParser::getReadBufferSize() const { return _readBufferSize; }
+
+size_t WebParser::getOpenFileCacheSize() const { return _openFileCacheSize; }
+
+int WebParser::getOpenFileCacheValid() const { return _openFileCacheValid; }
+
+size_t WebParser::getResponseCacheSize() const { return _responseCacheSize; }
+
+size_t WebParser::getResponseCacheMaxFileSize() const { return _responseCacheMaxFileSize; }
+size_t WebParser::getClientBodyBufferSize() const { return _clientBodyBufferSize; }
+
+size_t WebParser::getProxyKeepaliveConnections() const { return _proxyKeepaliveConnections; }
+
+int WebParser::getProxyKeepaliveTimeout() const { return _proxyKeepaliveTimeout; }
+
+size_t WebParser::getProxyKeepaliveRequests() const { return _proxyKeepaliveRequests; }
+
+int WebParser::getProxyResolveInterval() const { return _proxyResolveInterval; }
+
 const std::string &WebParser::getCgiPass() const { return _cgiPass; }
 
 bool WebParser::checkBracePairs(std::string line)
@@ -167,6 +201,42 @@ ssize_t WebParser::locateDirective(size_t contextStart, size_t contextEnd, std::
     }
 }
 
+//Same as locateDirective, but only considers lines outside of any context (brace depth 0)
+//Since a global directive may well be on line 0, -2 is returned if it can't be found
+ssize_t WebParser::locateGlobalDirective(std::string key) const
+{
+    int     depth = 0;
+    int     matches = 0;
+    ssize_t directive_index = -2;
+
+    for (size_t line = 0; line < _configFile.size(); line++)
+    {
+        if (_configFile[line].find('{') != std::string::npos)
+        {
+            depth++;
+            continue;
+        }
+        if (_configFile[line].find('}') != std::string::npos)
+        {
+            depth--;
+            continue;
+        }
+        if (depth != 0)
+            continue;
+        size_t i = 0;
+        while (isspace(_configFile[line][i]))
+            i++;
+        if (_configFile[line].find(key, i) == i)
+        {
+            matches++;
+            directive_index = line;
+        }
+    }
+    if (matches > 1)
+        return (-1);
+    return (directive_index);
+}
+
 void WebParser::parseServer(void)
 {
     size_t i;
@@ -191,6 +261,393 @@ void WebParser::parseServer(void)
         throw WebErrors::ConfigFormatException("Error: configuration file must contain at least one server context");
 }
 
+//upstream contexts are parsed before the servers, so that proxy_pass can refer to them
+void WebParser::parseUpstreams(void)
+{
+    int depth = 0;
+
+    for (size_t i = 0; i < _configFile.size(); i++)
+    {
+        if (depth == 0 && locateUpstreamContextStart(_configFile[i]))
+        {
+            ssize_t contextEnd = locateContextEnd(i);
+            if (contextEnd == -1)
+                throw WebErrors::ConfigFormatException("Error: context not closed properly");
+            extractUpstreamInfo(i, contextEnd);
+            i = contextEnd;
+        }
+        else if (_configFile[i].find('{') != std::string::npos)
+            depth++;
+        else if (_configFile[i].find('}') != std::string::npos)
+            depth--;
+    }
+}
+
+void WebParser::extractUpstreamInfo(size_t contextStart, size_t contextEnd)
+{
+    Upstream upstream;
+
+    upstream.name = extractUpstreamName(contextStart);
+    for (const Upstream &other : _upstreams)
+    {
+        if (other.name == upstream.name)
+            throw WebErrors::ConfigFormatException("Error: upstream '" + upstream.name + "' is defined twice");
+    }
+    upstream.balance = extractBalanceMethod(contextStart, contextEnd);
+    for (size_t i = contextStart + 1; i < contextEnd; i++)
+    {
+        if (locateDirective(i, i + 1, "server ") != 0)
+            upstream.servers.push_back(extractUpstreamServer(removeDirectiveKey(_configFile[i], "server")));
+    }
+    if (upstream.servers.empty())
+        throw WebErrors::ConfigFormatException("Error: upstream '" + upstream.name + "' must contain at least one server");
+    _upstreams.push_back(upstream);
+    extractHealthCheck(contextStart, contextEnd);
+}
+
+std::string WebParser::extractUpstreamName(size_t contextStart) const
+{
+    std::stringstream   stream(_configFile[contextStart]);
+    std::string         keyword;
+    std::string         name;
+
+    stream >> keyword >> name;
+    return (name);
+}
+
+//optional, round_robin by default. least_conn sends to the server with the fewest requests in progress (relative
+//to its weight), hash always sends the same URI to the same server, and moves few URIs when a server goes down
+BalanceMethod WebParser::extractBalanceMethod(size_t contextStart, size_t contextEnd) const
+{
+    ssize_t directiveLocation = locateDirective(contextStart, contextEnd, "balance");
+
+    if (directiveLocation == -1)
+        throw WebErrors::ConfigFormatException("Error: only one 'balance' directive per upstream context is allowed");
+    if (directiveLocation == 0)
+        return (ROUND_ROBIN);
+
+    std::string value = removeDirectiveKey(_configFile[directiveLocation], "balance");
+    if (value == "round_robin")
+        return (ROUND_ROBIN);
+    if (value == "least_conn")
+        return (LEAST_CONN);
+    if (value == "hash")
+        return (URI_HASH);
+    throw WebErrors::ConfigFormatException("Error: 'balance' must be round_robin, least_conn or hash");
+}
+
+//server host:port [weight=N] [max_fails=N] [fail_timeout=seconds]
+//a server that fails max_fails times within fail_timeout seconds gets no requests for the next fail_timeout seconds
+UpstreamServer WebParser::extractUpstreamServer(const std::string &line) const
+{
+    std::stringstream   stream(line);
+    std::string         parameter;
+    UpstreamServer      server = {"", 1, 1, 10};
+
+    stream >> server.address;
+    size_t colonPos = server.address.rfind(':');
+    if (colonPos == std::string::npos || colonPos == 0 || colonPos + 1 == server.address.length()
+        || server.address.find_first_not_of("0123456789", colonPos + 1) != std::string::npos)
+        throw WebErrors::ConfigFormatException("Error: upstream server must be given as host:port");
+
+    while (stream >> parameter)
+    {
+        size_t      equalPos = parameter.find('=');
+        std::string name = parameter.substr(0, equalPos);
+        std::string value = equalPos == std::string::npos ? "" : parameter.substr(equalPos + 1);
+        int         *target = nullptr;
+        int         minValue = 0;
+
+        if (name == "weight")
+        {
+            target = &server.weight;
+            minValue = 1;
+        }
+        else if (name == "max_fails")
+            target = &server.max_fails;
+        else if (name == "fail_timeout")
+        {
+            target = &server.fail_timeout;
+            minValue = 1;
+        }
+        if (!target)
+            throw WebErrors::ConfigFormatException("Error: unknown upstream server parameter '" + parameter + "'");
+        if (value.empty() || value.length() > 4 || value.find_first_not_of("0123456789") != std::string::npos
+            || std::stoi(value) < minValue)
+            throw WebErrors::ConfigFormatException("Error: '" + name + "' must be a number from " + std::to_string(minValue) + " to 9999");
+        *target = std::stoi(value);
+    }
+    return (server);
+}
+
+//optional: health_check <uri> [interval]. Every interval seconds (10 by default) each server gets a GET for the
+//uri, and one that doesn't answer it with a 2xx or 3xx status gets no requests until it does
+void WebParser::extractHealthCheck(size_t contextStart, size_t contextEnd)
+{
+    ssize_t directiveLocation = locateDirective(contextStart, contextEnd, "health_check");
+
+    _upstreams.back().health_check_interval = 10;
+    if (directiveLocation == -1)
+        throw WebErrors::ConfigFormatException("Error: only one 'health_check' directive per upstream context is allowed");
+    if (directiveLocation == 0)
+        return ;
+
+    std::stringstream   stream(removeDirectiveKey(_configFile[directiveLocation], "health_check"));
+    std::string         uri;
+    std::string         interval;
+    std::string         leftover;
+
+    stream >> uri >> interval >> leftover;
+    if (uri.empty() || uri[0] != '/')
+        throw WebErrors::ConfigFormatException("Error: 'health_check' uri must start with /");
+    if (!leftover.empty())
+        throw WebErrors::ConfigFormatException("Error: 'health_check' takes a uri and an interval");
+    if (!interval.empty())
+    {
+        if (interval.length() > 4 || interval.find_first_not_of("0123456789") != std::string::npos
+            || std::stoi(interval) < 1 || std::stoi(interval) > 3600)
+            throw WebErrors::ConfigFormatException("Error: 'health_check' interval must be a number of seconds between 1 and 3600");
+        _upstreams.back().health_check_interval = std::stoi(interval);
+    }
+    _upstreams.back().health_check_uri = uri;
+}
+
+void WebParser::extractGlobalInfo(void)
+{
+    _workerThreads = extractWorkerThreads();
+    _workerCpuAffinity = extractWorkerCpuAffinity();
+    _edgeTriggered = extractEdgeTriggered();
+    _readBufferSize = extractReadBufferSize();
+    _openFileCacheSize = extractOpenFileCacheSize();
+    _openFileCacheValid = extractOpenFileCacheValid();
+    _responseCacheSize = extractResponseCacheSize("response_cache_size", 16000000);
+    _responseCacheMaxFileSize = extractResponseCacheSize("response_cache_max_file_size", 256000);
+    _clientBodyBufferSize = extractClientBodyBufferSize();
+    _proxyKeepaliveConnections = extractProxySetting("proxy_keepalive_connections", 16, 0, 1024);
+    _proxyKeepaliveTimeout = extractProxySetting("proxy_keepalive_timeout", 60, 1, 3600);
+    _proxyKeepaliveRequests = extractProxySetting("proxy_keepalive_requests", 1000, 1, 1000000);
+    _proxyResolveInterval = extractProxySetting("proxy_resolve_interval", 30, 0, 86400);
+}
+
+//optional, defaults to 1 (a single event loop in the main thread)
+//'auto' will start one worker per available core
+int WebParser::extractWorkerThreads(void) const
+{
+    std::string key = "worker_threads";
+    ssize_t     directiveLocation = locateGlobalDirective(key);
+
+    if (directiveLocation == -1)
+        throw WebErrors::ConfigFormatException("Error: only one 'worker_threads' directive is allowed");
+    if (directiveLocation == -2)
+        return (1);
+
+    std::string line = removeDirectiveKey(_configFile[directiveLocation], key);
+    if (line.compare("auto") == 0)
+        return (std::max(1, std::min(static_cast<int>(std::thread::hardware_concurrency()), MAX_WORKER_THREADS)));
+
+    std::stringstream stream(line);
+    int               workerThreads;
+    std::string       leftover;
+
+    stream >> workerThreads;
+    if (stream.fail())
+        throw WebErrors::ConfigFormatException("Error: 'worker_threads' must be a number or 'auto'");
+    stream >> leftover;
+    if (!leftover.empty())
+        throw WebErrors::ConfigFormatException("Error: 'worker_threads' must be (just) a number or 'auto'");
+    if (workerThreads < 1 || workerThreads > MAX_WORKER_THREADS)
+        throw WebErrors::ConfigFormatException("Error: 'worker_threads' must be in the range 1 - " + std::to_string(MAX_WORKER_THREADS));
+    return (workerThreads);
+}
+
+bool WebParser::extractWorkerCpuAffinity(void) const
+{
+    std::string key = "worker_cpu_affinity";
+    ssize_t     directiveLocation = locateGlobalDirective(key);
+
+    if (directiveLocation == -1)
+        throw WebErrors::ConfigFormatException("Error: only one 'worker_cpu_affinity' directive is allowed");
+    if (directiveLocation == -2)
+        return (false);
+
+    std::string line = removeDirectiveKey(_configFile[directiveLocation], key);
+    if (line.compare("on") == 0)
+        return (true);
+    if (line.compare("off") != 0)
+        throw WebErrors::ConfigFormatException("Error: 'worker_cpu_affinity' may only have the value 'on' or 'off'");
+    return (false);
+}
+
+//optional, off by default: sockets and pipes are registered in epoll as level-triggered
+//if turned on (EPOLLET), every wakeup reads/accepts/writes until the kernel reports EAGAIN
+bool WebParser::extractEdgeTriggered(void) const
+{
+    std::string key = "edge_triggered";
+    ssize_t     directiveLocation = locateGlobalDirective(key);
+
+    if (directiveLocation == -1)
+        throw WebErrors::ConfigFormatException("Error: only one 'edge_triggered' directive is allowed");
+    if (directiveLocation == -2)
+        return (false);
+
+    std::string line = removeDirectiveKey(_configFile[directiveLocation], key);
+    if (line.compare("on") == 0)
+        return (true);
+    if (line.compare("off") != 0)
+        throw WebErrors::ConfigFormatException("Error: 'edge_triggered' may only have the value 'on' or 'off'");
+    return (false);
+}
+
+//optional, size of the buffer each recv() from a client reads into, defaults to 64K
+size_t WebParser::extractReadBufferSize(void) const
+{
+    std::string key = "read_buffer_size";
+    ssize_t     directiveLocation = locateGlobalDirective(key);
+
+    if (directiveLocation == -1)
+        throw WebErrors::ConfigFormatException("Error: only one 'read_buffer_size' directive is allowed");
+    if (directiveLocation == -2)
+        return (65536);
+
+    long size = parseByteSize(removeDirectiveKey(_configFile[directiveLocation], key), key);
+    if (size < 1024 || size > 16000000)
+        throw WebErrors::ConfigFormatException("Error: 'read_buffer_size' must be between 1K and 16M");
+    return (static_cast<size_t>(size));
+}
+
+//optional, the number of paths each worker keeps stat() results and open fds for, 0 turns the cache off
+//the default leaves the workers a quarter of the process's fd limit between them, at most 1000 each
+size_t WebParser::extractOpenFileCacheSize(void) const
+{
+    std::string key = "open_file_cache_size";
+    ssize_t     directiveLocation = locateGlobalDirective(key);
+
+    if (directiveLocation == -1)
+        throw WebErrors::ConfigFormatException("Error: only one 'open_file_cache_size' directive is allowed");
+    if (directiveLocation == -2)
+    {
+        struct rlimit   limit;
+        size_t          entries = 1000;
+
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+            entries = std::min(entries, static_cast<size_t>(limit.rlim_cur / 4 / _workerThreads));
+        return (entries);
+    }
+
+    std::string line = removeDirectiveKey(_configFile[directiveLocation], key);
+
+    std::stringstream stream(line);
+    long              entries;
+    std::string       leftover;
+
+    stream >> entries;
+    if (stream.fail() || entries < 0 || entries > 1000000)
+        throw WebErrors::ConfigFormatException("Error: 'open_file_cache_size' must be a number in the range 0 - 1000000");
+    stream >> leftover;
+    if (!leftover.empty())
+        throw WebErrors::ConfigFormatException("Error: 'open_file_cache_size' must be (just) a number");
+    return (static_cast<size_t>(entries));
+}
+
+//optional, value in seconds, defaults to 5. How long a cached entry is trusted before the file is looked at again
+int WebParser::extractOpenFileCacheValid(void) const
+{
+    std::string key = "open_file_cache_valid";
+    ssize_t     directiveLocation = locateGlobalDirective(key);
+
+    if (directiveLocation == -1)
+        throw WebErrors::ConfigFormatException("Error: only one 'open_file_cache_valid' directive is allowed");
+    if (directiveLocation == -2)
+        return (5);
+
+    std::string line = removeDirectiveKey(_configFile[directiveLocation], key);
+
+    std::stringstream stream(line);
+    int               seconds;
+    std::string       leftover;
+
+    stream >> seconds;
+    if (stream.fail() || seconds < 1)
+        throw WebErrors::ConfigFormatException("Error: 'open_file_cache_valid' must be a positive number of seconds");
+    stream >> leftover;
+    if (!leftover.empty())
+        throw WebErrors::ConfigFormatException("Error: 'open_file_cache_valid' must be (just) a number of seconds");
+    return (seconds);
+}
+
+//optional, in bytes with the same units as client_max_body_size. response_cache_size is the memory each worker
+//may use for cached static responses (16M by default, 0 turns the cache off), response_cache_max_file_size
+//the largest file that gets cached (256K by default), bigger ones are always sent with sendfile()
+size_t WebParser::extractResponseCacheSize(const std::string &key, size_t defaultSize) const
+{
+    ssize_t directiveLocation = locateGlobalDirective(key);
+
+    if (directiveLocation == -1)
+        throw WebErrors::ConfigFormatException("Error: only one '" + key + "' directive is allowed");
+    if (directiveLocation == -2)
+        return (defaultSize);
+
+    std::string value = removeDirectiveKey(_configFile[directiveLocation], key);
+    if (value == "0")
+        return (0);
+
+    long size = parseByteSize(value, key);
+    if (size > 1000000000)
+        throw WebErrors::ConfigFormatException("Error: '" + key + "' must be between 0 and 1000M");
+    return (static_cast<size_t>(size));
+}
+
+//optional, defaults to 16K. Request bodies up to this size are kept in memory, bigger ones are written to an
+//unlinked temporary file while they arrive, so client_max_body_size can be large. 0 sends every body to disk
+size_t WebParser::extractClientBodyBufferSize(void) const
+{
+    std::string key = "client_body_buffer_size";
+    ssize_t     directiveLocation = locateGlobalDirective(key);
+
+    if (directiveLocation == -1)
+        throw WebErrors::ConfigFormatException("Error: only one 'client_body_buffer_size' directive is allowed");
+    if (directiveLocation == -2)
+        return (16384);
+
+    std::string value = removeDirectiveKey(_configFile[directiveLocation], key);
+    if (value == "0")
+        return (0);
+
+    long size = parseByteSize(value, key);
+    if (size > 1000000)
+        throw WebErrors::ConfigFormatException("Error: 'client_body_buffer_size' must be between 0 and 1M");
+    return (static_cast<size_t>(size));
+}
+
+//optional. Idle connections to proxy_pass upstreams are kept open and reused by the next proxied request:
+//proxy_keepalive_connections is how many per upstream and worker (16 by default, 0 turns it off),
+//proxy_keepalive_timeout for how many seconds (60) and proxy_keepalive_requests for how many requests (1000).
+//proxy_resolve_interval is the number of seconds between two lookups of the upstream host names (30, 0 turns it off)
+int WebParser::extractProxySetting(const std::string &key, int defaultValue, int minValue, int maxValue) const
+{
+    ssize_t directiveLocation = locateGlobalDirective(key);
+
+    if (directiveLocation == -1)
+        throw WebErrors::ConfigFormatException("Error: only one '" + key + "' directive is allowed");
+    if (directiveLocation == -2)
+        return (defaultValue);
+
+    std::string line = removeDirectiveKey(_configFile[directiveLocation], key);
+
+    std::stringstream stream(line);
+    int               value;
+    std::string       leftover;
+
+    stream >> value;
+    if (stream.fail() || value < minValue || value > maxValue)
+        throw WebErrors::ConfigFormatException("Error: '" + key + "' must be a number in the range "
+            + std::to_string(minValue) + "-" + std::to_string(maxValue));
+    stream >> leftover;
+    if (!leftover.empty())
+        throw WebErrors::ConfigFormatException("Error: '" + key + "' must be (just) a number");
+    return (value);
+}
+
 void WebParser::extractServerInfo(size_t contextStart, size_t contextEnd)
 {
     Server  currentServer;
@@ -201,6 +658,11 @@ void WebParser::extractServerInfo(size_t contextStart, size_t contextEnd)
     _servers.back().client_max_body_size = extractClientMaxBodySize(contextStart, contextEnd);
     _servers.back().host = extractHost(contextStart, contextEnd);
     _servers.back().server_root = extractServerRoot(contextStart, contextEnd);
+    _servers.back().keepalive_timeout = extractKeepaliveTimeout(contextStart, contextEnd);
+    _servers.back().keepalive_requests = extractKeepaliveRequests(contextStart, contextEnd);
+    _servers.back().client_header_timeout = extractClientTimeout(contextStart, contextEnd, "client_header_timeout");
+    _servers.back().client_body_timeout = extractClientTimeout(contextStart, contextEnd, "client_body_timeout");
+    _servers.back().send_timeout = extractClientTimeout(contextStart, contextEnd, "send_timeout");
     extractErrorPageInfo(contextStart, contextEnd);
 
     size_t i;
@@ -232,10 +694,12 @@ void    WebParser::extractLocationInfo(size_t contextStart, size_t contextEnd)
     currentLocation.uri = extractLocationUri(contextStart);
     currentLocation.root = extractRoot(contextStart, contextEnd);
     currentLocation.upload_folder = extractUploadFolder(contextStart, contextEnd);
+    currentLocation.cgi_interpreter = extractCgiInterpreter(contextStart, contextEnd);
     _servers.back().locations.push_back(currentLocation);
     extractAllowedMethods(contextStart, contextEnd);
     extractAutoinex(contextStart, contextEnd);
     extractRedirectionAndTarget(contextStart, contextEnd);
+    extractCgiPool(contextStart, contextEnd);
     extractIndex(contextStart, contextEnd);
 }
 
@@ -404,6 +868,85 @@ std::string     WebParser::extractHost(size_t contextStart, size_t contextEnd) c
     return (line);
 }
 
+//optional, value in seconds, defaults to 75 like in nginx
+//setting it to 0 disables keep-alive: the connection is closed after every response
+int WebParser::extractKeepaliveTimeout(size_t contextStart, size_t contextEnd) const
+{
+    std::string key = "keepalive_timeout";
+    ssize_t     directiveLocation = locateDirective(contextStart, contextEnd, key);
+
+    if (directiveLocation == -1)
+        throw WebErrors::ConfigFormatException("Error: can only have one 'keepalive_timeout' directive per server context");
+    if (directiveLocation == 0)
+        return (75);
+
+    std::string line = removeDirectiveKey(_configFile[directiveLocation], key);
+
+    std::stringstream stream(line);
+    int               timeout;
+    std::string       leftover;
+
+    stream >> timeout;
+    if (stream.fail() || timeout < 0)
+        throw WebErrors::ConfigFormatException("Error: 'keepalive_timeout' must be a non-negative number of seconds");
+    stream >> leftover;
+    if (!leftover.empty())
+        throw WebErrors::ConfigFormatException("Error: 'keepalive_timeout' must be (just) a number of seconds");
+    return (timeout);
+}
+
+//optional, the amount of requests served through one connection before it is closed, defaults to 1000
+int WebParser::extractKeepaliveRequests(size_t contextStart, size_t contextEnd) const
+{
+    std::string key = "keepalive_requests";
+    ssize_t     directiveLocation = locateDirective(contextStart, contextEnd, key);
+
+    if (directiveLocation == -1)
+        throw WebErrors::ConfigFormatException("Error: can only have one 'keepalive_requests' directive per server context");
+    if (directiveLocation == 0)
+        return (1000);
+
+    std::string line = removeDirectiveKey(_configFile[directiveLocation], key);
+
+    std::stringstream stream(line);
+    int               requests;
+    std::string       leftover;
+
+    stream >> requests;
+    if (stream.fail() || requests < 1)
+        throw WebErrors::ConfigFormatException("Error: 'keepalive_requests' must be a positive number");
+    stream >> leftover;
+    if (!leftover.empty())
+        throw WebErrors::ConfigFormatException("Error: 'keepalive_requests' must be (just) a number");
+    return (requests);
+}
+
+//optional, value in seconds, defaults to 60 like in nginx. Used for client_header_timeout (whole header),
+//client_body_timeout (between two reads of the body) and send_timeout (between two writes of the response)
+int WebParser::extractClientTimeout(size_t contextStart, size_t contextEnd, const std::string &key) const
+{
+    ssize_t     directiveLocation = locateDirective(contextStart, contextEnd, key);
+
+    if (directiveLocation == -1)
+        throw WebErrors::ConfigFormatException("Error: can only have one '" + key + "' directive per server context");
+    if (directiveLocation == 0)
+        return (60);
+
+    std::string line = removeDirectiveKey(_configFile[directiveLocation], key);
+
+    std::stringstream stream(line);
+    int               timeout;
+    std::string       leftover;
+
+    stream >> timeout;
+    if (stream.fail() || timeout < 1)
+        throw WebErrors::ConfigFormatException("Error: '" + key + "' must be a positive number of seconds");
+    stream >> leftover;
+    if (!leftover.empty())
+        throw WebErrors::ConfigFormatException("Error: '" + key + "' must be (just) a number of seconds");
+    return (timeout);
+}
+
 //Extracts both the error codes, and the error page address. Does not process the error address yet
 //Will consider the field optional for now
 void    WebParser::extractErrorPageInfo(size_t contextStart, size_t contextEnd)
@@ -470,6 +1013,9 @@ void WebParser::printParsedInfo(void)
             std::cout << "Code: " << pair.first << " - Page: " << pair.second << std::endl;
         }
         std::cout << "Client body max size in bytes: " << servers[i].client_max_body_size << std::endl;
+        std::cout << "Keep-alive timeout: " << servers[i].keepalive_timeout << "s, max requests: " << servers[i].keepalive_requests << std::endl;
+        std::cout << "Timeouts: header " << servers[i].client_header_timeout << "s, body " << servers[i].client_body_timeout
+            << "s, send " << servers[i].send_timeout << "s" << std::endl;
         std::cout << "Location info for this server: " << std::endl;
         for (size_t h = 0; h < servers[i].locations.size(); h++)
         {
@@ -501,7 +1047,7 @@ void WebParser::printParsedInfo(void)
                 std::cout << "on" << std::endl;
             else
                 std::cout << "off" << std::endl;
-            std::cout << ">>> Redirection type {HTTP, CGI, PROXY, ALIAS, STANDARD}: " << servers[i].locations[h].type << std::endl;
+            std::cout << ">>> Redirection type {HTTP, CGI, PROXY, ALIAS, STANDARD, FASTCGI}: " << servers[i].locations[h].type << std::endl;
             std::cout << ">>> Target: " << servers[i].locations[h].target << std::endl;
             std::cout << ">>> Index files:" << std::endl;
             for (size_t s = 0; s < servers[i].locations[h].index.size(); s++)
@@ -509,6 +1055,7 @@ void WebParser::printParsedInfo(void)
                 std::cout << ">>>   " << servers[i].locations[h].index[s] << std::endl;
             }
             std::cout << "Upload folder: " << servers[i].locations[h].upload_folder << std::endl;
+            std::cout << "CGI interpreter: " << servers[i].locations[h].cgi_interpreter << std::endl;
         }
         std::cout << std::endl;
         i++;
@@ -591,6 +1138,63 @@ std::string             WebParser::extractUploadFolder(size_t contextStart, size
     return (line);
 }
 
+//optional, the program cgi_pass scripts are run with. Defaults to python3
+std::string WebParser::extractCgiInterpreter(size_t contextStart, size_t contextEnd) const
+{
+    std::string key = "cgi_interpreter";
+    ssize_t     directiveLocation = locateDirective(contextStart, contextEnd, key);
+
+    if (directiveLocation == -1)
+        throw WebErrors::ConfigFormatException("Error: only one 'cgi_interpreter' directive per location context is allowed");
+    if (directiveLocation == 0)
+        return (CGI_DEFAULT_INTERPRETER);
+
+    std::string line = removeDirectiveKey(_configFile[directiveLocation], key);
+    if (line.length() == 0 || line[0] != '/')
+        throw WebErrors::ConfigFormatException("Error: cgi_interpreter directive must be an absolute path");
+    if (access(line.c_str(), X_OK) != 0)
+        throw WebErrors::ConfigFormatException("Error: cgi_interpreter " + line + " is not executable");
+    return (line);
+}
+
+//optional, cgi_pass locations only. cgi_pool workers [queue=N]: the script is run by that many Python processes
+//started with the server, and up to N requests wait for one of them to be free
+void WebParser::extractCgiPool(size_t contextStart, size_t contextEnd)
+{
+    std::string key = "cgi_pool";
+    ssize_t     directiveLocation = locateDirective(contextStart, contextEnd, key);
+    Location    &location = _servers.back().locations.back();
+
+    if (directiveLocation == -1)
+        throw WebErrors::ConfigFormatException("Error: only one 'cgi_pool' directive per location context is allowed");
+    if (directiveLocation == 0)
+        return ;
+    if (location.type != CGI)
+        throw WebErrors::ConfigFormatException("Error: 'cgi_pool' is only allowed in cgi_pass locations");
+    if (std::filesystem::path(location.cgi_interpreter).filename().string().find("python") == std::string::npos)
+        throw WebErrors::ConfigFormatException("Error: 'cgi_pool' needs a Python cgi_interpreter");
+
+    std::stringstream   stream(removeDirectiveKey(_configFile[directiveLocation], key));
+    std::string         workers;
+    std::string         parameter;
+
+    stream >> workers;
+    if (workers.empty() || workers.length() > 2 || !std::all_of(workers.begin(), workers.end(), ::isdigit)
+        || std::stoi(workers) < 1 || std::stoi(workers) > CGI_POOL_MAX_WORKERS)
+        throw WebErrors::ConfigFormatException("Error: 'cgi_pool' must be between 1 and " + std::to_string(CGI_POOL_MAX_WORKERS));
+    location.cgi_pool = std::stoi(workers);
+    location.cgi_pool_queue = CGI_POOL_DEFAULT_QUEUE;
+    while (stream >> parameter)
+    {
+        const std::string value = parameter.substr(parameter.find('=') + 1);
+
+        if (parameter.compare(0, 6, "queue=") != 0 || value.empty() || value.length() > 4
+            || !std::all_of(value.begin(), value.end(), ::isdigit))
+            throw WebErrors::ConfigFormatException("Error: invalid 'cgi_pool' parameter: " + parameter);
+        location.cgi_pool_queue = std::stoul(value);
+    }
+}
+
 //location context should always contain this, whether cgi-type or not
 std::string WebParser::extractRoot(size_t contextStart, size_t contextEnd) const
 {
@@ -602,9 +1206,9 @@ std::string WebParser::extractRoot(size_t contextStart, size_t contextEnd) const
     if (directiveLocation == 0)
     {   
         if (locateDirective(contextStart, contextEnd, "alias") != 0 || locateDirective(contextStart, contextEnd, "proxy_pass") != 0
-            || locateDirective(contextStart, contextEnd, "cgi_pass") != 0  || locateDirective(contextStart, contextEnd, "return") != 0)
+            || locateDirective(contextStart, contextEnd, "cgi_pass") != 0  || locateDirective(contextStart, contextEnd, "fastcgi_pass") != 0 || locateDirective(contextStart, contextEnd, "return") != 0)
             return ("");
-        throw WebErrors::ConfigFormatException("Error: please add the 'root' directive to all location contexts that do not contain 'proxy_pass', 'cgi_pass', 'return' or 'alias' directives");
+        throw WebErrors::ConfigFormatException("Error: please add the 'root' directive to all location contexts that do not contain 'proxy_pass', 'cgi_pass', 'fastcgi_pass', 'return' or 'alias' directives");
     }
     
     std::string line = removeDirectiveKey(_configFile[directiveLocation], key);
@@ -650,13 +1254,14 @@ void    WebParser::extractRedirectionAndTarget(size_t contextStart, size_t conte
     ssize_t     aliasLocation = locateDirective(contextStart, contextEnd, "alias");
     ssize_t     proxyLocation = locateDirective(contextStart, contextEnd, "proxy_pass");
     ssize_t     cgiLocation = locateDirective(contextStart, contextEnd, "cgi_pass");
+    ssize_t     fastcgiLocation = locateDirective(contextStart, contextEnd, "fastcgi_pass");
     ssize_t     httpRedirLocation = locateDirective(contextStart, contextEnd, "return");
 
-    if (aliasLocation == -1 || proxyLocation == -1 || cgiLocation == -1 || httpRedirLocation == -1)
+    if (aliasLocation == -1 || proxyLocation == -1 || cgiLocation == -1 || fastcgiLocation == -1 || httpRedirLocation == -1)
         throw WebErrors::ConfigFormatException("Error: only one redirection type directive per location context is allowed");
     else if (aliasLocation != 0)
     {
-        if (proxyLocation > 0 || cgiLocation  > 0 || httpRedirLocation > 0)
+        if (proxyLocation > 0 || cgiLocation  > 0 || fastcgiLocation > 0 || httpRedirLocation > 0)
             throw WebErrors::ConfigFormatException("Error: only one type of redirection allowed per location context");
         //parse the alias, and store it in location.target
         _servers.back().locations.back().target = removeDirectiveKey(_configFile[aliasLocation], "alias");
@@ -667,7 +1272,7 @@ void    WebParser::extractRedirectionAndTarget(size_t contextStart, size_t conte
     }
     else if (proxyLocation != 0)
     {
-        if (cgiLocation  > 0 || httpRedirLocation > 0)
+        if (cgiLocation  > 0 || fastcgiLocation > 0 || httpRedirLocation > 0)
             throw WebErrors::ConfigFormatException("Error: only one type of redirection allowed per location context");
         //parse the proxy_pass, and store it in location.target
         //no error checking is done yet
@@ -677,6 +1282,19 @@ void    WebParser::extractRedirectionAndTarget(size_t contextStart, size_t conte
         _servers.back().locations.back().type = PROXY;
         return ;
     }
+    else if (fastcgiLocation != 0)
+    {
+        if (cgiLocation  > 0 || httpRedirLocation > 0)
+            throw WebErrors::ConfigFormatException("Error: only one type of redirection allowed per location context");
+        //host:port, unix:/path or the name of an upstream context, resolved like a proxy_pass target
+        _servers.back().locations.back().target = removeDirectiveKey(_configFile[fastcgiLocation], "fastcgi_pass");
+        if (_servers.back().locations.back().target.size() == 0)
+            throw WebErrors::ConfigFormatException("Error: fastcgi_pass directive cannot be empty");
+        if (_servers.back().locations.back().target.compare(0, 5, "unix:") == 0 && _servers.back().locations.back().target[5] != '/')
+            throw WebErrors::ConfigFormatException("Error: fastcgi_pass unix socket path must start with /");
+        _servers.back().locations.back().type = FASTCGI;
+        return ;
+    }
     else if (cgiLocation != 0)
     {
         if (httpRedirLocation > 0)
@@ -12,8 +12,15 @@
 #include <unistd.h>
 #include <cstring>
 #include <regex>
+#include <thread>
 
-enum LocationType { HTTP_REDIR, CGI, PROXY, ALIAS, STANDARD };
+#define MAX_WORKER_THREADS 64
+#define CGI_DEFAULT_INTERPRETER "/bin/python3"
+#define CGI_POOL_MAX_WORKERS 64
+#define CGI_POOL_DEFAULT_QUEUE 16
+
+enum LocationType { HTTP_REDIR, CGI, PROXY, ALIAS, STANDARD, FASTCGI };
+enum BalanceMethod { ROUND_ROBIN, LEAST_CONN, URI_HASH };
 
 struct Location {
     LocationType                type;
@@ -26,6 +33,9 @@ struct Location {
     bool                        allowedDELETE;
     bool                        autoIndexOn;
     std::string                 upload_folder;
+    std::string                 cgi_interpreter;
+    int                         cgi_pool = 0;           // pre-started workers for the cgi_pass script, 0: one process per request
+    size_t                      cgi_pool_queue = 0;     // requests that may wait for a busy pool
     std::string                 httpRedirection;
     std::vector<std::string>    index;
 };
@@ -38,6 +48,27 @@ struct Server {
     std::map<int, std::string>     error_page;
     std::vector<Location>          locations;
     std::string                    server_root;
+    int                            keepalive_timeout;
+    int                            keepalive_requests;
+    int                            client_header_timeout;
+    int                            client_body_timeout;
+    int                            send_timeout;
+};
+
+struct UpstreamServer {
+    std::string                 address;                // host:port
+    int                         weight;
+    int                         max_fails;              // 0 never takes the server out
+    int                         fail_timeout;
+};
+
+/* A group of servers that proxy_pass can name instead of a single host:port */
+struct Upstream {
+    std::string                     name;
+    BalanceMethod                   balance;
+    std::vector<UpstreamServer>     servers;
+    std::string                     health_check_uri;   // empty when the servers are not probed
+    int                             health_check_interval;
 };
 
 class WebParser
@@ -54,6 +85,20 @@ public:
     const std::string         &getProxyPass() const;
     const std::string         &getCgiPass() const;
     const std::vector<Server> &getServers() const;
+    const std::vector<Upstream> &getUpstreams() const;
+    int                       getWorkerThreads() const;
+    bool                      getWorkerCpuAffinity() const;
+    bool                      getEdgeTriggered() const;
+    size_t                    getReadBufferSize() const;
+    size_t                    getOpenFileCacheSize() const;
+    int                       getOpenFileCacheValid() const;
+    size_t                    getResponseCacheSize() const;
+    size_t                    getResponseCacheMaxFileSize() const;
+    size_t                    getClientBodyBufferSize() const;
+    size_t                    getProxyKeepaliveConnections() const;
+    int                       getProxyKeepaliveTimeout() const;
+    size_t                    getProxyKeepaliveRequests() const;
+    int                       getProxyResolveInterval() const;
     static std::string               getErrorPage(int errorCode, const Server *server);
 
     //for testing:
@@ -71,13 +116,44 @@ private:
     std::string             _cgiPass;
     std::stack<char>        _bracePairCheckStack;
     std::vector<Server>     _servers;
+    std::vector<Upstream>   _upstreams;
+    int                     _workerThreads = 1;
+    bool                    _workerCpuAffinity = false;
+    bool                    _edgeTriggered = false;
+    size_t                  _readBufferSize = 65536;
+    size_t                  _openFileCacheSize = 1000;
+    int                     _openFileCacheValid = 5;
+    size_t                  _responseCacheSize = 16000000;
+    size_t                  _responseCacheMaxFileSize = 256000;
+    size_t                  _clientBodyBufferSize = 16384;
+    size_t                  _proxyKeepaliveConnections = 16;
+    int                     _proxyKeepaliveTimeout = 60;
+    size_t                  _proxyKeepaliveRequests = 1000;
+    int                     _proxyResolveInterval = 30;
 
     void                        parseProxyPass(const std::string &line);
     void                        parseCgiPass(const std::string &line);
     bool                        checkBracePairs(std::string line);
     ssize_t                     locateContextEnd(size_t contextStart) const;
     ssize_t                     locateDirective(size_t contextStart, size_t contextEnd, std::string key) const;
+    ssize_t                     locateGlobalDirective(std::string key) const;
     void                        parseServer(void);
+    void                        parseUpstreams(void);
+    void                        extractUpstreamInfo(size_t contextStart, size_t contextEnd);
+    std::string                 extractUpstreamName(size_t contextStart) const;
+    BalanceMethod               extractBalanceMethod(size_t contextStart, size_t contextEnd) const;
+    UpstreamServer              extractUpstreamServer(const std::string &line) const;
+    void                        extractHealthCheck(size_t contextStart, size_t contextEnd);
+    void                        extractGlobalInfo(void);
+    int                         extractWorkerThreads(void) const;
+    bool                        extractWorkerCpuAffinity(void) const;
+    bool                        extractEdgeTriggered(void) const;
+    size_t                      extractReadBufferSize(void) const;
+    size_t                      extractOpenFileCacheSize(void) const;
+    int                         extractOpenFileCacheValid(void) const;
+    size_t                      extractResponseCacheSize(const std::string &key, size_t defaultSize) const;
+    size_t                      extractClientBodyBufferSize(void) const;
+    int                         extractProxySetting(const std::string &key, int defaultValue, int minValue, int maxValue) const;
     void                        extractServerInfo(size_t contextStart, size_t contextEnd);
     void                        extractLocationInfo(size_t contextStart, size_t contextEnd);
     int                         extractPort(size_t contextStart, size_t contextEnd) const;
@@ -85,6 +161,9 @@ private:
     long                        extractClientMaxBodySize(size_t contextStart, size_t contextEnd) const;
     std::string                 extractServerRoot(size_t contextStart, size_t contextEnd) const;
     std::string                 extractHost(size_t contextStart, size_t contextEnd) const;
+    int                         extractKeepaliveTimeout(size_t contextStart, size_t contextEnd) const;
+    int                         extractKeepaliveRequests(size_t contextStart, size_t contextEnd) const;
+    int                         extractClientTimeout(size_t contextStart, size_t contextEnd, const std::string &key) const;
     void                        extractErrorPageInfo(size_t contextStart, size_t contextEnd);
     std::string                 extractLocationUri(size_t contextStart) const;
     void                        extractAllowedMethods(size_t contextStart, size_t contextEnd);
@@ -93,6 +172,8 @@ private:
     void                        extractRedirectionAndTarget(size_t contextStart, size_t contextEnd);
     void                        extractIndex(size_t contextStart, size_t contextEnd);
     std::string                 extractUploadFolder(size_t contextStart, size_t contextEnd);
+    std::string                 extractCgiInterpreter(size_t contextStart, size_t contextEnd) const;
+    void                        extractCgiPool(size_t contextStart, size_t contextEnd);
 
     //in WebParserUtils
 
@@ -102,8 +183,10 @@ private:
     static bool                     checkBracesPerLine(std::string line);
     static bool                     locateServerContextStart(std::string line, std::string contextName);
     static bool                     locateLocationContextStart(std::string line, std::string contextName);
+    static bool                     locateUpstreamContextStart(std::string line);
     static std::string              removeDirectiveKey(std::string line, std::string key);
     static std::string              createStandardTarget(std::string uri, std::string root);
     static bool                     verifyTarget(std::string path);
     static int                      getErrorCode(std::string line);
+    static long                     parseByteSize(const std::string &value, const std::string &key);
 };
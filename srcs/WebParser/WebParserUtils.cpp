@@ -130,6 +130,20 @@ bool    WebParser::locateLocationContextStart(std::string line, std::string cont
     return (true);
 }
 
+//upstream <name> {, the name being a single word that can't start with '/'
+bool    WebParser::locateUpstreamContextStart(std::string line)
+{
+    std::stringstream   stream(line);
+    std::string         keyword;
+    std::string         name;
+    std::string         brace;
+    std::string         leftover;
+
+    stream >> keyword >> name >> brace >> leftover;
+    return (keyword == "upstream" && !name.empty() && name[0] != '/' && name != "{" && brace == "{"
+        && leftover.empty() && line.back() == '{');
+}
+
 //also removes the semicolon from the end of the directive
 std::string WebParser::removeDirectiveKey(std::string line, std::string key)
 {
@@ -268,3 +282,28 @@ std::string   WebParser::getErrorPage(int errorCode, const Server *server)
     }
     return (errorPage);
 }
+
+//Parses values like '64K' or '2M' into bytes (units are powers of 1000, same as client_max_body_size)
+long    WebParser::parseByteSize(const std::string &value, const std::string &key)
+{
+    std::stringstream   stream(value);
+    long                numericComponent;
+    std::string         unit;
+
+    stream >> numericComponent;
+    if (stream.fail() || numericComponent <= 0)
+        throw WebErrors::ConfigFormatException("Error: '" + key + "' must have a positive numeric component");
+    stream >> unit;
+    if (stream.fail())
+        return (numericComponent);
+    long multiplier;
+    if (unit.compare("K") == 0)
+        multiplier = 1000;
+    else if (unit.compare("M") == 0)
+        multiplier = 1000000;
+    else
+        throw WebErrors::ConfigFormatException("Error: '" + key + "' unit must be 'K' for kilobytes or 'M' for megabytes");
+    if (numericComponent > (LONG_MAX / multiplier))
+        throw WebErrors::ConfigFormatException("Error: '" + key + "' can't be larger than LONG_MAX");
+    return (numericComponent * multiplier);
+}
@@ -0,0 +1,297 @@
+#include "CGIPool.hpp"
+#include "CGIHandler.hpp"
+#include "WebErrors.hpp"
+#include "WebServer.hpp"
+#include "WorkerPool.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* What each worker runs: fd 3 brings requests ("<variables size> <body size> <body file or ->\n", the variables
+   separated by NULs, then the body unless it is in a file), fd 4 takes back the script's output as it is printed,
+   each write as "<size>\n<bytes>", and "0\n" once the script is done */
+static const char *const CGI_POOL_RUNNER = R"PY(
+import io, os, runpy, sys, traceback
+requests, responses = os.fdopen(3, 'rb', buffering=0), os.fdopen(4, 'wb', buffering=0)
+script, home, environment = sys.argv[1], os.getcwd(), dict(os.environ)
+
+class Output(io.RawIOBase):
+    def writable(self):
+        return True
+
+    def write(self, data):
+        data = memoryview(data).cast('B')
+        for start in range(0, len(data), 65536):  # the server holds a piece whole before passing it on
+            piece = data[start:start + 65536]
+            responses.write(b'%d\n' % len(piece) + piece)
+        return len(data)
+
+    def close(self):  # the script closing sys.stdout must not end the response
+        pass
+
+def read(size):
+    data = b''
+    while len(data) < size:
+        piece = requests.read(size - len(data))
+        if not piece:
+            sys.exit(0)
+        data += piece
+    return data
+
+while True:
+    header = b''
+    while not header.endswith(b'\n'):
+        header += read(1)
+    variables_size, body_size, body_path = header.decode().split(' ', 2)
+    variables = read(int(variables_size)).decode('utf-8', 'surrogateescape').split('\0')
+    body_path = body_path.strip()
+    body = open(body_path, 'rb') if body_path != '-' else io.BytesIO(read(int(body_size)))
+    os.environ.clear()
+    os.environ.update(environment)
+    os.environ.update(variable.split('=', 1) for variable in variables if '=' in variable)
+    output = Output()
+    sys.stdin = io.TextIOWrapper(body, encoding='utf-8', errors='surrogateescape')
+    sys.stdout = io.TextIOWrapper(output, encoding='utf-8', errors='surrogateescape', write_through=True)
+    try:
+        runpy.run_path(script, run_name='__main__')
+    except SystemExit:
+        pass
+    except BaseException:
+        traceback.print_exc()
+    if not sys.stdout.closed:
+        sys.stdout.flush()
+    body.close()
+    os.chdir(home)
+    responses.write(b'0\n')
+)PY";
+
+CGIPool::CGIPool(const Location &location)
+    : _script(std::filesystem::absolute("." + location.target).lexically_normal().string()),
+      _interpreter(location.cgi_interpreter), _queueLimit(location.cgi_pool_queue), _workers(location.cgi_pool)
+{
+    for (Worker &worker : _workers)
+        replace(worker);
+}
+
+CGIPool::~CGIPool()
+{
+    for (Worker &worker : _workers)
+        stop(worker);
+}
+
+/* A body kept in memory goes through the pipe with the CGI variables, they have to fit in it. A request that
+   doesn't is run the usual way */
+bool CGIPool::accepts(const Request &request) const
+{
+    const RequestData &data = request.getRequestData();
+
+    return data.bodyFile || buildRequestHead(request).size() + data.body.size() <= _pipeSize;
+}
+
+/* Hands the request to an idle worker, starting it again first if it is gone. Returns nullptr if all of them are
+   busy, throws if no worker can be started */
+CGIPool::Worker *CGIPool::dispatch(const Request &request)
+{
+    auto worker = std::find_if(_workers.begin(), _workers.end(), [](const Worker &w) { return !w.busy; });
+
+    if (worker == _workers.end())
+        return nullptr;
+
+    const RequestData   &data = request.getRequestData();
+    const std::string   message = buildRequestHead(request) + (data.bodyFile ? "" : data.body);
+
+    // an idle worker may have exited since its last request, the write then fails and it is replaced once
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        if (worker->pid == -1)
+            spawn(*worker);
+        if (message.size() > worker->pipeSize) // its pipe came out smaller than accepts() assumed, it is not dead
+            throw WebErrors::BaseException("Request does not fit in the pipe of the CGI pool worker for " + _script);
+        if (write(worker->requestFd, message.data(), message.size()) == static_cast<ssize_t>(message.size()))
+        {
+            worker->busy = true;
+            return &*worker;
+        }
+        stop(*worker);
+    }
+    throw WebErrors::BaseException("CGI pool worker for " + _script + " does not take requests");
+}
+
+/* The response came back whole, the worker waits for the next request */
+void CGIPool::release(Worker &worker) { worker.busy = false; }
+
+/* For a worker that died or timed out. If the new one can't be started, it is tried again on the next request */
+void CGIPool::replace(Worker &worker)
+{
+    stop(worker);
+    try
+    {
+        spawn(worker);
+    }
+    catch (const std::exception &e)
+    {
+        WebErrors::printerror("CGIPool::replace", e.what());
+    }
+}
+
+bool CGIPool::enqueue(int clientSocket)
+{
+    if (_queue.size() >= _queueLimit)
+        return false;
+    _queue.push_back(clientSocket);
+    return true;
+}
+
+/* The next client waiting for a worker, -1 if there is none */
+int CGIPool::dequeue(void)
+{
+    if (_queue.empty())
+        return -1;
+
+    const int clientSocket = _queue.front();
+
+    _queue.pop_front();
+    return clientSocket;
+}
+
+void CGIPool::cancel(int clientSocket) { _queue.erase(std::remove(_queue.begin(), _queue.end(), clientSocket), _queue.end()); }
+
+/* Moves the whole pieces of output in `frames` to the stream. True once the end of the response is among them */
+bool CGIPool::takeOutput(std::string &frames, CGIStream &stream)
+{
+    size_t start = 0;
+
+    while (true)
+    {
+        const size_t lineEnd = frames.find('\n', start);
+
+        if (lineEnd == std::string::npos)
+            break;
+
+        const size_t length = std::strtoul(frames.c_str() + start, nullptr, 10);
+
+        if (length == 0)
+        {
+            frames.clear();
+            return true;
+        }
+        if (frames.length() - lineEnd - 1 < length)
+            break;
+        stream.append(frames.data() + lineEnd + 1, length);
+        start = lineEnd + 1 + length;
+    }
+    frames.erase(0, start);
+    return false;
+}
+
+/* Started like a cgi_pass script (posix_spawn, in the script's directory), but with the two pipes of the protocol
+   as fds 3 and 4. What the script prints outside of its response goes to the server's stderr */
+void CGIPool::spawn(Worker &worker)
+{
+    int requestPipe[2];
+    int responsePipe[2];
+
+    if (pipe2(requestPipe, O_CLOEXEC) == -1)
+        throw WebErrors::BaseException("Error creating CGI pool pipes");
+    if (pipe2(responsePipe, O_CLOEXEC) == -1)
+    {
+        close(requestPipe[READEND]);
+        close(requestPipe[WRITEND]);
+        throw WebErrors::BaseException("Error creating CGI pool pipes");
+    }
+    fcntl(requestPipe[WRITEND], F_SETPIPE_SZ, CGI_POOL_PIPE_SIZE); // may fail, what the pipe holds is asked below
+
+    const int pipeSize = fcntl(requestPipe[WRITEND], F_GETPIPE_SZ);
+
+    for (int *fd : {&requestPipe[READEND], &responsePipe[WRITEND]}) // they must not already be fd 3 or 4
+    {
+        if (*fd <= 4)
+        {
+            const int moved = fcntl(*fd, F_DUPFD_CLOEXEC, 5);
+
+            close(*fd);
+            *fd = moved;
+        }
+    }
+
+    const std::string           scriptDir = std::filesystem::path(_script).parent_path().string();
+    char *const                 argv[] = { const_cast<char *>(_interpreter.c_str()), const_cast<char *>("-c"),
+                                    const_cast<char *>(CGI_POOL_RUNNER), const_cast<char *>(_script.c_str()), NULL };
+    const std::string           path = CGIHandler::pathVariable();
+    char *const                 envp[] = { const_cast<char *>(path.c_str()), NULL };
+    posix_spawn_file_actions_t  actions;
+    posix_spawnattr_t           attributes;
+    sigset_t                    signals;
+    pid_t                       pid = -1;
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, requestPipe[READEND], 3);
+    posix_spawn_file_actions_adddup2(&actions, responsePipe[WRITEND], 4);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, STDERR_FILENO, STDOUT_FILENO);
+    posix_spawn_file_actions_addclosefrom_np(&actions, 5);
+    posix_spawn_file_actions_addchdir_np(&actions, scriptDir.c_str());
+    posix_spawnattr_init(&attributes);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+    sigemptyset(&signals);
+    posix_spawnattr_setsigmask(&attributes, &signals);
+    sigaddset(&signals, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attributes, &signals);
+
+    const int error = posix_spawn(&pid, _interpreter.c_str(), &actions, &attributes, argv, envp);
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attributes);
+    close(requestPipe[READEND]);
+    close(responsePipe[WRITEND]);
+    if (error != 0)
+    {
+        close(requestPipe[WRITEND]);
+        close(responsePipe[READEND]);
+        throw WebErrors::BaseException("Error starting CGI pool worker for " + _script + ": " + strerror(error));
+    }
+    WorkerPool::releaseCpu(pid);
+    WebServer::setFdNonBlocking(requestPipe[WRITEND]);
+    WebServer::setFdNonBlocking(responsePipe[READEND]);
+    worker.pid = pid;
+    worker.requestFd = requestPipe[WRITEND];
+    worker.responseFd = responsePipe[READEND];
+    worker.pipeSize = std::max(pipeSize, 0);
+    worker.busy = false;
+    _pipeSize = std::min(_pipeSize, worker.pipeSize);
+}
+
+void CGIPool::stop(Worker &worker)
+{
+    if (worker.requestFd != -1)
+        close(worker.requestFd);
+    if (worker.responseFd != -1)
+        close(worker.responseFd);
+    if (worker.pid > 0)
+    {
+        kill(worker.pid, SIGKILL);
+        waitpid(worker.pid, nullptr, 0);
+    }
+    worker = Worker();
+}
+
+/* The message header and the CGI variables, followed by the body unless it is in a file */
+std::string CGIPool::buildRequestHead(const Request &request) const
+{
+    const RequestData   &data = request.getRequestData();
+    std::string         variables;
+    std::string         bodyPath = "-";
+
+    for (const std::string &variable : CGIHandler::buildEnvironment(request, data.uri))
+        variables += variable + '\0';
+    if (data.bodyFile) // read by the worker through this process's fd table, the file may have no name
+        bodyPath = "/proc/" + std::to_string(getpid()) + "/fd/" + std::to_string(data.bodyFile->fd);
+    return std::to_string(variables.size()) + " " + std::to_string(data.bodyFile ? 0 : data.body.size())
+        + " " + bodyPath + "\n" + variables;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "CGIStream.hpp"
+#include "Request.hpp"
+#include "WebParser.hpp"
+#include <deque>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+#define CGI_POOL_PIPE_SIZE (1024 * 1024)    // asked for the request pipes, the kernel may give less (pipe-max-size)
+
+/* Interpreters started ahead of time for one cgi_pass script (cgi_pool), per script and owned by each WebServer.
+   Each runs a small Python loop: it reads a request from a pipe (the CGI variables, then the body, or the path of
+   the file it was spilled to), runs the script in-process with runpy, and writes its output back as it is printed,
+   in pieces prefixed by their length. No process is created on the request path, and whatever the script imports
+   stays loaded. A request that finds every worker busy waits in a bounded queue. A worker that dies or is killed
+   is replaced */
+class CGIPool
+{
+public:
+    struct Worker
+    {
+        pid_t   pid = -1;           // -1 if it could not be started, it is tried again on the next request
+        int     requestFd = -1;     // the worker reads requests from it
+        int     responseFd = -1;    // and writes responses to it
+        size_t  pipeSize = 0;       // what the request pipe holds, a request is written in one go
+        bool    busy = false;
+    };
+
+    CGIPool(const Location &location);
+    ~CGIPool();
+    CGIPool(const CGIPool &) = delete;
+    CGIPool &operator=(const CGIPool &) = delete;
+
+    bool        accepts(const Request &request) const;
+    Worker      *dispatch(const Request &request);
+    void        release(Worker &worker);
+    void        replace(Worker &worker);
+    bool        enqueue(int clientSocket);
+    int         dequeue(void);
+    void        cancel(int clientSocket);
+
+    static bool takeOutput(std::string &frames, CGIStream &stream);
+
+private:
+    std::string         _script;
+    std::string         _interpreter;
+    size_t              _queueLimit;
+    size_t              _pipeSize = CGI_POOL_PIPE_SIZE; // the smallest request pipe a worker got
+    std::vector<Worker> _workers;   // never resized, WebServer keeps pointers to the workers it is waiting on
+    std::deque<int>     _queue;     // clients whose front request waits for a worker
+
+    void                spawn(Worker &worker);
+    void                stop(Worker &worker);
+    std::string         buildRequestHead(const Request &request) const;
+};
@@ -0,0 +1,97 @@
+#include "FileCache.hpp"
+#include <fcntl.h>
+#include <filesystem>
+#include <sys/stat.h>
+#include <unistd.h>
+
+OpenFile::OpenFile(int fd) : fd(fd) {}
+
+OpenFile::~OpenFile()
+{
+    if (fd != -1)
+        close(fd);
+}
+
+FileCache::FileCache(size_t maxEntries, int validSeconds)
+    : _maxEntries(maxEntries), _valid(validSeconds)
+{
+}
+
+/* A hit costs no system calls at all. openFile also asks for an open fd, which is then kept with the entry */
+FileInfo FileCache::lookup(const std::string &path, bool openFile)
+{
+    if (_maxEntries == 0)
+    {
+        FileInfo info = statPath(path);
+        if (openFile)
+            openPath(info);
+        return info;
+    }
+
+    const auto  now = std::chrono::steady_clock::now();
+    auto        it = _entries.find(path);
+
+    if (it != _entries.end() && now >= it->second.validUntil)
+    {
+        _lru.erase(it->second.lruPosition);
+        _entries.erase(it);
+        it = _entries.end();
+    }
+    if (it == _entries.end())
+    {
+        if (_entries.size() >= _maxEntries)
+        {
+            _entries.erase(_lru.back());
+            _lru.pop_back();
+        }
+        _lru.push_front(path);
+        it = _entries.emplace(path, Entry{statPath(path), now + _valid, _lru.begin()}).first;
+    }
+    else
+        _lru.splice(_lru.begin(), _lru, it->second.lruPosition);
+
+    if (openFile && !it->second.info.file)
+        openPath(it->second.info);
+    return it->second.info;
+}
+
+FileInfo FileCache::statPath(const std::string &path)
+{
+    FileInfo    info;
+    struct stat pathStat;
+
+    std::error_code error;
+    info.absolutePath = std::filesystem::absolute(path, error).generic_string();
+    if (error)
+        info.absolutePath = path;
+    if (stat(path.c_str(), &pathStat) == -1)
+        return info;
+    info.exists = true;
+    info.isDirectory = S_ISDIR(pathStat.st_mode);
+    info.isRegular = S_ISREG(pathStat.st_mode);
+    info.readable = access(path.c_str(), R_OK) == 0;
+    info.size = pathStat.st_size;
+    info.mtime = pathStat.st_mtime;
+    return info;
+}
+
+/* The size is taken again from the open fd, so it always matches what sendfile() is going to find */
+void FileCache::openPath(FileInfo &info)
+{
+    if (!info.isRegular || !info.readable)
+        return;
+
+    const int   fd = open(info.absolutePath.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat fileStat;
+
+    if (fd == -1)
+        return;
+    info.file = std::make_shared<OpenFile>(fd);
+    if (fstat(fd, &fileStat) == -1 || !S_ISREG(fileStat.st_mode))
+    {
+        info.file.reset();
+        return;
+    }
+    info.size = fileStat.st_size;
+    info.mtime = fileStat.st_mtime;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <chrono>
+#include <ctime>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+/* An open file descriptor, closed when the last user lets go of it. The cache and every response
+   still sending the file share it, so evicting an entry never cuts a download short */
+struct OpenFile
+{
+    int fd = -1;
+
+    explicit OpenFile(int fd);
+    ~OpenFile();
+    OpenFile(const OpenFile &) = delete;
+    OpenFile &operator=(const OpenFile &) = delete;
+};
+
+/* What the request validator and the static file handler need to know about a path */
+struct FileInfo
+{
+    std::string                 absolutePath;
+    bool                        exists = false;
+    bool                        isDirectory = false;
+    bool                        isRegular = false;
+    bool                        readable = false;
+    size_t                      size = 0;
+    time_t                      mtime = 0;
+    std::shared_ptr<OpenFile>   file;           // only opened when asked for, regular readable files only
+};
+
+/* open_file_cache: stat() and access() results (missing files included) and open fds per path, owned by each
+   WebServer so no locking is needed. Entries are trusted for `validSeconds`, then looked up again; when
+   `maxEntries` is reached the least recently used one goes. With maxEntries 0 every lookup hits the filesystem */
+class FileCache
+{
+public:
+    FileCache(size_t maxEntries, int validSeconds);
+    ~FileCache() = default;
+    FileCache(const FileCache &) = delete;
+    FileCache &operator=(const FileCache &) = delete;
+
+    FileInfo    lookup(const std::string &path, bool openFile = false);
+
+private:
+    struct Entry
+    {
+        FileInfo                                info;
+        std::chrono::steady_clock::time_point   validUntil;
+        std::list<std::string>::iterator        lruPosition;
+    };
+
+    size_t                                  _maxEntries;
+    std::chrono::seconds                    _valid;
+    std::unordered_map<std::string, Entry>  _entries;
+    std::list<std::string>                  _lru;           // most recently used at the front
+
+    static FileInfo                         statPath(const std::string &path);
+    static void                             openPath(FileInfo &info);
+};
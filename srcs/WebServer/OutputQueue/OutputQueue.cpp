@@ -0,0 +1,122 @@
+#include "OutputQueue.hpp"
+#include <cerrno>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+void OutputQueue::push(std::string data)
+{
+    if (data.empty())
+        return;
+    _pendingBytes += data.length();
+    _chunks.push_back(Chunk());
+    _chunks.back().length = data.length();
+    _chunks.back().data = std::move(data);
+}
+
+/* The buffer is never copied, it only has to stay unchanged until it is sent */
+void OutputQueue::pushShared(std::shared_ptr<const std::string> data)
+{
+    if (!data || data->empty())
+        return;
+    _pendingBytes += data->length();
+    _chunks.push_back(Chunk());
+    _chunks.back().length = data->length();
+    _chunks.back().shared = std::move(data);
+}
+
+/* The file stays open at least until it has been sent or the queue is cleared */
+void OutputQueue::pushFile(std::shared_ptr<OpenFile> file, size_t length)
+{
+    if (!file || length == 0)
+        return;
+    _pendingBytes += length;
+    _chunks.push_back(Chunk());
+    _chunks.back().file = std::move(file);
+    _chunks.back().length = length;
+}
+
+bool OutputQueue::empty() const { return _chunks.empty(); }
+
+size_t OutputQueue::size() const { return _pendingBytes; }
+
+void OutputQueue::clear()
+{
+    while (!_chunks.empty())
+        popFront();
+    _pendingBytes = 0;
+}
+
+void OutputQueue::popFront()
+{
+    _chunks.pop_front();
+    _offset = 0;
+}
+
+const char *OutputQueue::Chunk::bytes() const { return shared ? shared->data() : data.data(); }
+
+/* Writes until everything is sent or the kernel buffer is full (PENDING: wait for the next EPOLLOUT).
+   MSG_MORE holds back data that is followed by more, so headers leave in the same segment as the file */
+OutputQueue::FlushStatus OutputQueue::flush(int fd)
+{
+    while (!_chunks.empty())
+    {
+        Chunk   &chunk = _chunks.front();
+        ssize_t sent;
+
+        if (chunk.file)
+        {
+            off_t fileOffset = _offset;
+            sent = sendfile(fd, chunk.file->fd, &fileOffset, chunk.length - _offset);
+            if (sent == 0) // the file got shorter than the Content-Length already sent
+                return FAILED;
+        }
+        else
+            sent = sendMemoryChunks(fd);
+
+        if (sent > 0)
+            consume(sent);
+        else if (sent == -1 && errno == EINTR)
+            continue;
+        else if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return PENDING;
+        else
+            return FAILED;
+    }
+    return FLUSHED;
+}
+
+/* One sendmsg() for all the in-memory chunks at the front of the queue, up to the first file */
+ssize_t OutputQueue::sendMemoryChunks(int fd)
+{
+    struct iovec    iov[OUTPUT_QUEUE_MAX_IOV];
+    struct msghdr   message = {};
+    size_t          count = 0;
+
+    for (auto it = _chunks.begin(); it != _chunks.end() && !it->file && count < OUTPUT_QUEUE_MAX_IOV; ++it, ++count)
+    {
+        const size_t skip = (count == 0) ? _offset : 0;
+        iov[count].iov_base = const_cast<char *>(it->bytes() + skip);
+        iov[count].iov_len = it->length - skip;
+    }
+    message.msg_iov = iov;
+    message.msg_iovlen = count;
+    return sendmsg(fd, &message, MSG_DONTWAIT | MSG_NOSIGNAL | (_chunks.size() > count ? MSG_MORE : 0));
+}
+
+void OutputQueue::consume(size_t sent)
+{
+    _pendingBytes -= sent;
+    while (sent > 0)
+    {
+        const size_t left = _chunks.front().length - _offset;
+
+        if (sent < left)
+        {
+            _offset += sent;
+            return;
+        }
+        sent -= left;
+        popFront();
+    }
+}
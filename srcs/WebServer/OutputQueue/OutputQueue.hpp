@@ -0,0 +1,51 @@
+#pragma once
+
+#include "FileCache.hpp"
+#include <deque>
+#include <memory>
+#include <string>
+#include <sys/types.h>
+
+#define OUTPUT_QUEUE_MAX_IOV 16
+
+/* Bytes waiting to be written to a client socket. A response that does not fit in the
+   socket buffer is written in several rounds, resuming from where the last send() stopped.
+   Consecutive in-memory chunks leave in one gathered write, static files are queued as an open fd
+   and go from the page cache to the socket with sendfile() */
+class OutputQueue
+{
+public:
+    enum FlushStatus { FLUSHED, PENDING, FAILED };
+
+    OutputQueue() = default;
+    ~OutputQueue() = default;
+    OutputQueue(const OutputQueue &) = delete;
+    OutputQueue &operator=(const OutputQueue &) = delete;
+
+    void        push(std::string data);
+    void        pushShared(std::shared_ptr<const std::string> data);
+    void        pushFile(std::shared_ptr<OpenFile> file, size_t length);
+    bool        empty() const;
+    size_t      size() const;
+    void        clear();
+    FlushStatus flush(int fd);
+
+private:
+    struct Chunk
+    {
+        std::string                         data;
+        std::shared_ptr<const std::string>  shared; // when set, the bytes are this buffer (shared with a cache) instead of `data`
+        std::shared_ptr<OpenFile>           file;   // when set, the chunk is `length` bytes of this file instead of `data`
+        size_t                              length = 0;
+
+        const char  *bytes() const;
+    };
+
+    std::deque<Chunk>   _chunks;
+    size_t              _offset = 0;
+    size_t              _pendingBytes = 0;
+
+    void                popFront();
+    ssize_t             sendMemoryChunks(int fd);
+    void                consume(size_t sent);
+};
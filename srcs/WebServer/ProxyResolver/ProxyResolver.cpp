@@ -0,0 +1,170 @@
+#include "ProxyResolver.hpp"
+#include "WebServer.hpp"
+#include "WebErrors.hpp"
+#include <cstring>
+#include <iostream>
+#include <sys/un.h>
+
+/* The first lookup blocks, nothing can be proxied before it. A name that can't be resolved then is a config error */
+ProxyResolver::ProxyResolver(const std::vector<std::string> &names, int refreshInterval)
+    : _names(names), _refreshInterval(refreshInterval)
+{
+    for (const std::string &name : _names)
+    {
+        AddressList addresses = resolve(name);
+
+        if (!addresses)
+            throw WebErrors::ProxyException( "Error resolving proxy address " + name );
+        _entries.emplace(name, Entry{std::move(addresses), 0, 0});
+        for (const addrinfo *address = _entries.at(name).addresses.get(); address; address = address->ai_next)
+            _entries.at(name).count++;
+    }
+    if (refreshInterval > 0 && !_names.empty())
+        _thread = std::thread(&ProxyResolver::refreshRoutine, this);
+}
+
+ProxyResolver::~ProxyResolver()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _wakeUp.notify_one();
+    if (_thread.joinable())
+        _thread.join();
+}
+
+/* The address to connect to, nullptr for a name that was never resolved. Only valid until the next collect() */
+const addrinfo *ProxyResolver::lookup(const std::string &name) const
+{
+    auto it = _entries.find(name);
+    if (it == _entries.end())
+        return nullptr;
+
+    const addrinfo *address = it->second.addresses.get();
+
+    for (size_t i = 0; i < it->second.preferred; i++)
+        address = address->ai_next;
+    return address;
+}
+
+size_t ProxyResolver::addressCount(const std::string &name) const
+{
+    auto it = _entries.find(name);
+    return it == _entries.end() ? 0 : it->second.count;
+}
+
+/* Only moves on if `address` is still the one connections go to: several connections to it may fail together */
+void ProxyResolver::reportFailure(const std::string &name, const addrinfo *address)
+{
+    auto it = _entries.find(name);
+    if (it == _entries.end() || it->second.count < 2 || lookup(name) != address)
+        return;
+    it->second.preferred = (it->second.preferred + 1) % it->second.count;
+}
+
+/* Takes what the thread looked up since the last call. Returns the names whose addresses changed, connections
+   kept open to the old ones should not be reused */
+std::vector<std::string> ProxyResolver::collect(void)
+{
+    std::unordered_map<std::string, AddressList>    fresh;
+    std::vector<std::string>                        changed;
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        fresh.swap(_fresh);
+    }
+    for (auto &[name, addresses] : fresh)
+    {
+        Entry &entry = _entries.at(name);
+
+        if (sameAddresses(entry.addresses.get(), addresses.get()))
+            continue;
+        entry.addresses = std::move(addresses);
+        entry.count = 0;
+        entry.preferred = 0;
+        for (const addrinfo *address = entry.addresses.get(); address; address = address->ai_next)
+            entry.count++;
+        changed.push_back(name);
+        std::cout << COLOR_GREEN_SERVER << "  Upstream server " << name << " has new addresses 🔄\n\n" << COLOR_RESET;
+    }
+    return changed;
+}
+
+/* Looks every name up again each interval, outside the lock, until the resolver is destroyed */
+void ProxyResolver::refreshRoutine(void)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    while (!_wakeUp.wait_for(lock, _refreshInterval, [this] { return _stopping; }))
+    {
+        lock.unlock();
+
+        std::unordered_map<std::string, AddressList> fresh;
+
+        for (const std::string &name : _names)
+        {
+            AddressList addresses = resolve(name);
+
+            if (addresses)
+                fresh.emplace(name, std::move(addresses));
+        }
+        lock.lock();
+        for (auto &[name, addresses] : fresh)
+            _fresh.insert_or_assign(name, std::move(addresses));
+    }
+}
+
+/* name is host:port, or unix:/path for a local socket. Returns an empty list if it can't be resolved */
+ProxyResolver::AddressList ProxyResolver::resolve(const std::string &name)
+{
+    const size_t    colonPos = name.rfind(':');
+    addrinfo        hints{};
+    addrinfo        *addresses = nullptr;
+
+    if (name.compare(0, 5, "unix:") == 0)
+        return unixAddress(name.substr(5));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (colonPos == std::string::npos
+        || getaddrinfo(name.substr(0, colonPos).c_str(), name.substr(colonPos + 1).c_str(), &hints, &addresses) != 0)
+        addresses = nullptr;
+    return AddressList(addresses, freeaddrinfo);
+}
+
+/* The one entry getaddrinfo would have made for the socket path, freed with freeUnixAddress() */
+ProxyResolver::AddressList ProxyResolver::unixAddress(const std::string &path)
+{
+    sockaddr_un address{};
+
+    if (path.empty() || path.length() >= sizeof(address.sun_path))
+        return AddressList(nullptr, freeUnixAddress);
+    address.sun_family = AF_UNIX;
+    std::memcpy(address.sun_path, path.c_str(), path.length());
+
+    addrinfo *entry = new addrinfo{};
+
+    entry->ai_family = AF_UNIX;
+    entry->ai_socktype = SOCK_STREAM;
+    entry->ai_addrlen = sizeof(address);
+    entry->ai_addr = reinterpret_cast<sockaddr *>(new sockaddr_un(address));
+    return AddressList(entry, freeUnixAddress);
+}
+
+void ProxyResolver::freeUnixAddress(addrinfo *address)
+{
+    if (!address)
+        return;
+    delete reinterpret_cast<sockaddr_un *>(address->ai_addr);
+    delete address;
+}
+
+bool ProxyResolver::sameAddresses(const addrinfo *first, const addrinfo *second)
+{
+    for (; first && second; first = first->ai_next, second = second->ai_next)
+    {
+        if (first->ai_addrlen != second->ai_addrlen || std::memcmp(first->ai_addr, second->ai_addr, first->ai_addrlen) != 0)
+            return false;
+    }
+    return !first && !second;
+}
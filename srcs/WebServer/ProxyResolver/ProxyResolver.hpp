@@ -0,0 +1,56 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <netdb.h>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/* The addresses of the upstream servers, by host:port, owned by each WebServer. They are looked up once when the
+   worker starts, then again every `refreshInterval` seconds by a thread of the resolver, so the event loop never
+   waits on DNS: it only picks up the new addresses with collect(). A name that can't be looked up again keeps its
+   last addresses. When a name has several, a connection that could not be made moves the next ones on to the
+   following address */
+class ProxyResolver
+{
+public:
+    ProxyResolver(const std::vector<std::string> &names, int refreshInterval);
+    ~ProxyResolver();
+    ProxyResolver(const ProxyResolver &) = delete;
+    ProxyResolver &operator=(const ProxyResolver &) = delete;
+
+    const addrinfo              *lookup(const std::string &name) const;
+    size_t                      addressCount(const std::string &name) const;
+    void                        reportFailure(const std::string &name, const addrinfo *address);
+    std::vector<std::string>    collect(void);
+
+private:
+    using AddressList = std::unique_ptr<addrinfo, void (*)(addrinfo *)>;
+
+    struct Entry
+    {
+        AddressList     addresses;
+        size_t          count;
+        size_t          preferred;  // the address connections go to
+    };
+
+    std::unordered_map<std::string, Entry>          _entries;   // only used by the event loop
+    std::vector<std::string>                        _names;
+    std::chrono::seconds                            _refreshInterval;
+
+    std::mutex                                      _mutex;
+    std::condition_variable                         _wakeUp;
+    bool                                            _stopping = false;
+    std::unordered_map<std::string, AddressList>    _fresh;     // looked up by the thread, not collected yet
+    std::thread                                     _thread;
+
+    void                refreshRoutine(void);
+    static AddressList  resolve(const std::string &name);
+    static AddressList  unixAddress(const std::string &path);
+    static void         freeUnixAddress(addrinfo *address);
+    static bool         sameAddresses(const addrinfo *first, const addrinfo *second);
+};
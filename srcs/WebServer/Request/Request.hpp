@@ -5,6 +5,8 @@
 #include <unordered_map>
 #include <netdb.h> 
 #include "WebParser.hpp"
+#include "FileCache.hpp"
+#include "ResponseCache.hpp"
 
 struct RequestData
 {
@@ -14,7 +16,9 @@ struct RequestData
     std::string query_string;
     std::unordered_map<std::string, std::string> headers;
     std::unordered_map<std::string, std::string> cookies;
-    std::string body;  
+    std::string body;                       // empty when the body was spilled to bodyFile
+    std::shared_ptr<OpenFile> bodyFile;
+    size_t      bodySize = 0;
     std::string script_filename;
     std::string content_type; 
     std::string content_length;
@@ -41,6 +45,14 @@ inline std::ostream& operator<<(std::ostream& os, const RequestData& requestData
     return os;
 }
 
+/* What RequestParser hands over once a request is complete */
+struct ParsedRequest
+{
+    RequestData data = {};
+    std::string raw;            // request line and headers exactly as received, forwarded as is by the proxy
+    size_t      headerSize = 0; // sum of the header names and values
+};
+
 enum ErrorCodes { INVALID_METHOD = 405, NOT_FOUND = 404, HTTP_VERSION_NOT_SUPPORTED = 505,\
     BAD_REQUEST = 400, REQUEST_BODY_TOO_LARGE = 413, URI_TOO_LONG = 414, FORBIDDEN = 403, REQUEST_HEADER_FIELDS_TOO_LARGE = 431, INSUFFICIENT_STORAGE = 507,\
     NOT_IMPLEMENTED = 501, SERVER_ERROR = 500};
@@ -49,47 +61,41 @@ class Request
 {
 public:
     Request();
-    Request(const std::string& rawRequest, const std::vector<Server>& servers,\
-        const std::unordered_map<std::string, addrinfo*>& proxyInfoMap);
+    Request(ParsedRequest&& parsedRequest, const std::vector<Server>& servers,\
+        FileCache& fileCache, ResponseCache& responseCache);
 
     const std::string&  getRawRequest() const;
     const Server*       getServer() const;
     const Location*     getLocation() const;
-    addrinfo*           getProxyInfo() const;
     const RequestData&  getRequestData() const;
     int                 getErrorCode() const;
+    FileCache&          getFileCache() const;
+    ResponseCache&      getResponseCache() const;
 private:
     RequestData     _requestData = {};
     std::string     _rawRequest;
     const Server*   _server = nullptr;
     const Location* _location = nullptr;
-    addrinfo*       _proxyInfo;
-    size_t          _totalHeaderSize;
+    FileCache*      _fileCache = nullptr;
+    ResponseCache*  _responseCache = nullptr;
+    size_t          _totalHeaderSize = 0;
 
     int             _errorCode = 0;
 
-    void        parseCookies();  
-    void        parseRequest(void);
-    void        parseHeadersAndBody(std::istringstream& stream);
-    void        parseHeaderLine(const std::string& line);
-    void        setContentTypeAndLength();
-    std::string extractUri(const std::string& rawRequest) const;
-    void        parseRequestLine(const std::string& requestLine);
+    void        parseCookies();
 
 
 public:
     class RequestValidator
     {
     public:
-        RequestValidator(Request& request, const std::vector<Server>& servers,\
-            const std::unordered_map<std::string, addrinfo*>& proxyInfoMap);
+        RequestValidator(Request& request, const std::vector<Server>& servers);
         ~RequestValidator() = default;
         bool validate() const;
 
     private:
         Request&                                            _request;
         const std::vector<Server>&                          _servers;
-        const std::unordered_map<std::string, addrinfo*>&   _proxyInfoMap;
 
         bool checkForIndexing(std::string& fullPath) const;
         bool isPathValid()      const;
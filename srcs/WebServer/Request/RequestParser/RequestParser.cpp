@@ -0,0 +1,336 @@
+#include "RequestParser.hpp"
+#include "WebParser.hpp"
+#include "WebErrors.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <stdexcept>
+#include <strings.h>
+#include <system_error>
+#include <unistd.h>
+
+/* Returns true once a whole request has been read. Malformed requests throw std::runtime_error, failing to
+   store the body throws std::system_error. Consumed bytes are removed from the front of the buffer */
+bool RequestParser::parse(std::string &buffer)
+{
+    while (_state == REQUEST_LINE || _state == HEADERS)
+    {
+        if (_lineStart > MAX_HEADER_SECTION_SIZE)
+            throw std::runtime_error("Error parsing request: header section too large");
+
+        size_t lineEnd = buffer.find('\n', _scanPos);
+
+        if (lineEnd == std::string::npos)
+        {
+            _scanPos = buffer.length();
+            if (_scanPos > MAX_HEADER_SECTION_SIZE)
+                throw std::runtime_error("Error parsing request: header section too large");
+            return false;
+        }
+
+        size_t lineLength = lineEnd - _lineStart;
+        if (lineLength > 0 && buffer[lineEnd - 1] == '\r')
+            lineLength--;
+        const std::string line = buffer.substr(_lineStart, lineLength);
+
+        _lineStart = lineEnd + 1;
+        _scanPos = _lineStart;
+        if (_state == REQUEST_LINE)
+        {
+            if (!line.empty()) // empty lines before the request line are allowed (RFC 9112 2.2)
+                parseRequestLine(line);
+        }
+        else if (line.empty())
+            endOfHeaders(buffer);
+        else
+            parseHeaderLine(line);
+    }
+    if (_state == BODY && _chunked)
+        readChunkedBody(buffer);
+    else if (_state == BODY)
+        readBody(buffer);
+    return _state == COMPLETE;
+}
+
+/* Called once the headers are known to be acceptable. Bodies bigger than bodyBufferSize go to a file,
+   a chunked body that decodes to more than maxBodySize throws WebErrors::BodyTooLargeException */
+void RequestParser::acceptBody(size_t bodyBufferSize, long maxBodySize)
+{
+    if (_state != HEADERS_DONE)
+        throw std::runtime_error("Error: request headers are not complete yet");
+
+    _bodyBufferSize = bodyBufferSize;
+    _maxBodySize = maxBodySize;
+    _parsed.data.bodySize = _contentLength;
+    if (_contentLength > bodyBufferSize)
+        openSpillFile();
+    else
+        _parsed.data.body.reserve(_contentLength);
+    _state = BODY;
+}
+
+/* Moves the finished request out and gets ready for the next one */
+ParsedRequest RequestParser::takeRequest(void)
+{
+    if (_state != COMPLETE)
+        throw std::runtime_error("Error: request is not complete yet");
+
+    ParsedRequest parsed = std::move(_parsed);
+
+    reset();
+    return parsed;
+}
+
+void RequestParser::reset(void)
+{
+    _state = REQUEST_LINE;
+    _lineStart = 0;
+    _scanPos = 0;
+    _contentLength = 0;
+    _bodyReceived = 0;
+    _bodyBufferSize = 0;
+    _maxBodySize = 0;
+    _chunked = false;
+    _chunkState = CHUNK_SIZE;
+    _chunkRemaining = 0;
+    _trailerSize = 0;
+    _parsed = ParsedRequest();
+}
+
+void RequestParser::parseRequestLine(const std::string &line)
+{
+    std::string::size_type methodEnd = line.find(' ');
+    if (methodEnd == std::string::npos)
+        throw std::runtime_error( "Error parsing request line: missing method" );
+
+    std::string::size_type uriEnd = line.find(' ', methodEnd + 1);
+    if (uriEnd == std::string::npos)
+        throw std::runtime_error( "Error parsing request line: missing URI" );
+
+    RequestData &data = _parsed.data;
+
+    data.method = line.substr(0, methodEnd);
+    data.uri = line.substr(methodEnd + 1, uriEnd - methodEnd - 1);
+    data.httpVersion = WebParser::trimSpaces(line.substr(uriEnd + 1));
+
+    size_t queryPos = data.uri.find('?');
+    if (queryPos != std::string::npos)
+    {
+        data.query_string = data.uri.substr(queryPos + 1);
+        data.uri = data.uri.substr(0, queryPos);
+    }
+    _state = HEADERS;
+}
+
+void RequestParser::parseHeaderLine(const std::string &line)
+{
+    size_t pos = line.find(':');
+    if (pos == std::string::npos)
+        throw std::runtime_error( "Error parsing header line: missing ':'" );
+
+    std::string key = line.substr(0, pos);
+    std::string value = line.substr(pos + 1);
+
+    key.erase(key.find_last_not_of(" \t") + 1);
+    value.erase(0, value.find_first_not_of(" \t"));
+    value.erase(value.find_last_not_of(" \t") + 1);
+    _parsed.headerSize += key.length() + value.length();
+
+    if (strcasecmp(key.c_str(), "Content-Length") == 0)
+    {
+        if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos)
+            throw std::runtime_error( "Error parsing header line: invalid Content-Length" );
+        // repeated with another value, the request could be framed differently by a proxy in front (smuggling)
+        if (!_parsed.data.content_length.empty() && std::stoul(value) != _contentLength)
+            throw std::runtime_error( "Error parsing header line: conflicting Content-Length headers" );
+        _contentLength = std::stoul(value);
+        _parsed.data.content_length = value;
+    }
+    else if (strcasecmp(key.c_str(), "Transfer-Encoding") == 0)
+    {
+        if (strcasecmp(value.c_str(), "chunked") != 0)
+            throw std::runtime_error( "Error parsing header line: unsupported Transfer-Encoding" );
+        _chunked = true;
+    }
+    else if (strcasecmp(key.c_str(), "Content-Type") == 0)
+        _parsed.data.content_type = value;
+    _parsed.data.headers[key] = value;
+}
+
+/* The header section is kept for the proxy and dropped from the buffer, so only body bytes follow */
+void RequestParser::endOfHeaders(std::string &buffer)
+{
+    // Both framings at once is how requests get smuggled past proxies (RFC 9112 6.3)
+    if (_chunked && !_parsed.data.content_length.empty())
+        throw std::runtime_error("Error parsing request: both Content-Length and Transfer-Encoding");
+    _parsed.raw = buffer.substr(0, _lineStart);
+    buffer.erase(0, _lineStart);
+    _lineStart = 0;
+    _scanPos = 0;
+    _state = HEADERS_DONE;
+}
+
+void RequestParser::readBody(std::string &buffer)
+{
+    const size_t length = std::min(buffer.length(), _contentLength - _bodyReceived);
+
+    appendBody(buffer.data(), length);
+    buffer.erase(0, length);
+    if (_bodyReceived == _contentLength)
+        _state = COMPLETE;
+}
+
+/* chunk = size in hex [; extensions] CRLF, data CRLF. A zero size chunk ends the body, it can be followed
+   by trailer fields which are skipped, and a final empty line (RFC 9112 7.1) */
+void RequestParser::readChunkedBody(std::string &buffer)
+{
+    size_t pos = 0;
+
+    while (_state == BODY)
+    {
+        if (_chunkState == CHUNK_DATA)
+        {
+            const size_t length = std::min(buffer.length() - pos, _chunkRemaining);
+
+            appendBody(buffer.data() + pos, length);
+            pos += length;
+            _chunkRemaining -= length;
+            if (_chunkRemaining > 0)
+                break;
+            _chunkState = CHUNK_DATA_END;
+            continue;
+        }
+
+        const size_t lineEnd = buffer.find('\n', pos);
+        if (lineEnd == std::string::npos)
+        {
+            if (buffer.length() - pos > MAX_CHUNK_LINE_SIZE)
+                throw std::runtime_error("Error parsing chunked body: line too long");
+            break;
+        }
+
+        size_t lineLength = lineEnd - pos;
+        if (lineLength > 0 && buffer[lineEnd - 1] == '\r')
+            lineLength--;
+        const std::string line = buffer.substr(pos, lineLength);
+
+        pos = lineEnd + 1;
+        if (_chunkState == CHUNK_SIZE)
+            parseChunkSize(line);
+        else if (_chunkState == CHUNK_DATA_END)
+        {
+            if (!line.empty())
+                throw std::runtime_error("Error parsing chunked body: chunk data longer than its size");
+            _chunkState = CHUNK_SIZE;
+        }
+        else if (line.empty())
+            finishChunkedBody();
+        else if ((_trailerSize += line.length()) > MAX_HEADER_SECTION_SIZE)
+            throw std::runtime_error("Error parsing chunked body: trailer section too large");
+    }
+    buffer.erase(0, pos);
+}
+
+void RequestParser::parseChunkSize(const std::string &line)
+{
+    const std::string size = WebParser::trimSpaces(line.substr(0, line.find(';')));
+
+    if (size.empty() || size.length() > 15 || size.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos)
+        throw std::runtime_error("Error parsing chunked body: invalid chunk size");
+    _chunkRemaining = std::stoul(size, nullptr, 16);
+    if (_chunkRemaining == 0)
+    {
+        _chunkState = CHUNK_TRAILER;
+        return;
+    }
+    // Refused before the chunk is read, the size is already known
+    if (static_cast<long>(_bodyReceived + _chunkRemaining) > _maxBodySize)
+        throw WebErrors::BodyTooLargeException("Request body size exceeds client_max_body_size limit");
+    _chunkState = CHUNK_DATA;
+}
+
+/* A chunked body only moves to a file once it outgrows the body buffer, its length isn't known in advance */
+void RequestParser::appendBody(const char *data, size_t length)
+{
+    std::string &body = _parsed.data.body;
+
+    if (!_parsed.data.bodyFile && body.length() + length > _bodyBufferSize)
+    {
+        openSpillFile();
+        writeToSpillFile(body.data(), body.length());
+        std::string().swap(body);
+    }
+    if (_parsed.data.bodyFile)
+        writeToSpillFile(data, length);
+    else
+        body.append(data, length);
+    _bodyReceived += length;
+}
+
+/* The request is made to look like it had a Content-Length, for the CGI environment and for the proxy,
+   which forwards the decoded body */
+void RequestParser::finishChunkedBody(void)
+{
+    std::string &raw = _parsed.raw;
+    size_t      lineStart = raw.find('\n') + 1;
+
+    while (lineStart < raw.length())
+    {
+        const size_t lineEnd = raw.find('\n', lineStart);
+
+        if (strncasecmp(raw.c_str() + lineStart, "Transfer-Encoding:", 18) == 0)
+            raw.erase(lineStart, lineEnd + 1 - lineStart);
+        else
+            lineStart = lineEnd + 1;
+    }
+    const size_t headEnd = raw.length() - (raw.length() >= 2 && raw[raw.length() - 2] == '\r' ? 2 : 1);
+
+    _parsed.data.content_length = std::to_string(_bodyReceived);
+    _parsed.data.bodySize = _bodyReceived;
+    raw.insert(headEnd, "Content-Length: " + _parsed.data.content_length + "\r\n");
+    _state = COMPLETE;
+}
+
+/* O_TMPFILE gives a file without a name, so nothing is left behind whatever happens to the process */
+void RequestParser::openSpillFile(void)
+{
+    int fd = open(BODY_SPILL_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+
+    if (fd == -1 && (errno == EOPNOTSUPP || errno == EISDIR || errno == EINVAL))
+    {
+        char path[] = BODY_SPILL_DIR "/webserv_body_XXXXXX";
+
+        fd = mkostemp(path, O_CLOEXEC);
+        if (fd != -1)
+            unlink(path);
+    }
+    if (fd == -1)
+        throw std::system_error(errno, std::generic_category(), "Error creating a temporary file for the request body");
+    _parsed.data.bodyFile = std::make_shared<OpenFile>(fd);
+}
+
+void RequestParser::writeToSpillFile(const char *data, size_t length)
+{
+    for (size_t written = 0; written < length; )
+    {
+        const ssize_t ret = write(_parsed.data.bodyFile->fd, data + written, length - written);
+
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret == -1)
+            throw std::system_error(errno, std::generic_category(), "Error writing request body to disk");
+        written += ret;
+    }
+}
+
+RequestParser::State RequestParser::getState() const { return _state; }
+
+bool RequestParser::headersComplete() const { return _state == HEADERS_DONE || _state == BODY || _state == COMPLETE; }
+
+size_t RequestParser::getContentLength() const { return _contentLength; }
+
+const std::string *RequestParser::getHeader(const std::string &name) const
+{
+    auto it = _parsed.data.headers.find(name);
+    return it != _parsed.data.headers.end() ? &it->second : nullptr;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "Request.hpp"
+#include <string>
+
+#define MAX_HEADER_SECTION_SIZE 65536
+#define MAX_CHUNK_LINE_SIZE 4096
+#define BODY_SPILL_DIR "/tmp"
+
+/* Resumable request parser. It is fed the connection's receive buffer after every read and picks up
+   where it stopped, so every byte is looked at once no matter how many reads the request takes.
+   Lines are split, request line and headers are parsed as soon as they are complete. Then the parser
+   stops in HEADERS_DONE until the caller has checked the headers and called acceptBody(): from there on
+   body bytes are moved out of the receive buffer as they arrive, into memory when the body fits in
+   the body buffer, otherwise into an unlinked temporary file, so an upload never sits in memory whole.
+   A chunked body is decoded on the way: only the chunk data is stored, and the request comes out
+   looking as if it had been sent with a Content-Length */
+class RequestParser
+{
+public:
+    enum State { REQUEST_LINE, HEADERS, HEADERS_DONE, BODY, COMPLETE };
+
+    RequestParser() = default;
+    ~RequestParser() = default;
+
+    bool                parse(std::string &buffer);
+    void                acceptBody(size_t bodyBufferSize, long maxBodySize);
+    ParsedRequest       takeRequest(void);
+    void                reset(void);
+
+    State               getState() const;
+    bool                headersComplete() const;
+    size_t              getContentLength() const;
+    const std::string   *getHeader(const std::string &name) const;
+
+private:
+    enum ChunkState { CHUNK_SIZE, CHUNK_DATA, CHUNK_DATA_END, CHUNK_TRAILER };
+
+    State           _state = REQUEST_LINE;
+    size_t          _lineStart = 0;     // first byte of the line being parsed
+    size_t          _scanPos = 0;       // how far the buffer has been searched for the end of that line
+    size_t          _contentLength = 0;
+    size_t          _bodyReceived = 0;
+    size_t          _bodyBufferSize = 0;
+    long            _maxBodySize = 0;
+    bool            _chunked = false;
+    ChunkState      _chunkState = CHUNK_SIZE;
+    size_t          _chunkRemaining = 0;
+    size_t          _trailerSize = 0;
+    ParsedRequest   _parsed;
+
+    void            parseRequestLine(const std::string &line);
+    void            parseHeaderLine(const std::string &line);
+    void            endOfHeaders(std::string &buffer);
+    void            readBody(std::string &buffer);
+    void            readChunkedBody(std::string &buffer);
+    void            parseChunkSize(const std::string &line);
+    void            appendBody(const char *data, size_t length);
+    void            finishChunkedBody(void);
+    void            openSpillFile(void);
+    void            writeToSpillFile(const char *data, size_t length);
+};
@@ -5,16 +5,12 @@
 #include <sys/stat.h> 
 #include <filesystem>
 
-Request::RequestValidator::RequestValidator(Request& request, const std::vector<Server>& servers, const std::unordered_map<std::string, addrinfo*>& proxyInfoMap)
-    : _request(request), _servers(servers), _proxyInfoMap(proxyInfoMap) {}
+Request::RequestValidator::RequestValidator(Request& request, const std::vector<Server>& servers)
+    : _request(request), _servers(servers) {}
 
 bool Request::RequestValidator::isReadOk() const
 {
-    if (access(_request._requestData.uri.c_str(), R_OK) == -1)
-    {
-        return false;
-    }
-    return true;
+    return _request._fileCache->lookup(_request._requestData.uri).readable;
 }
 
 bool   Request::RequestValidator::isServerFull() const
@@ -27,7 +23,7 @@ bool   Request::RequestValidator::isServerFull() const
         std::filesystem::space_info space = std::filesystem::space(_request._requestData.uri);
         if (space.available < 1048576)//an arbitrary number
             return false;
-        if (_request._requestData.body.length() >= static_cast<size_t>(space.available))
+        if (_request._requestData.bodySize >= static_cast<size_t>(space.available))
             return false;
         return true;
     }
@@ -82,12 +78,13 @@ bool Request::RequestValidator::validate() const
                             _request._errorCode = INVALID_METHOD;
                             return true;
                         }
-                        if (_request.getServer()->client_max_body_size < static_cast<long>(_request._requestData.body.size()))
+                        if (_request.getServer()->client_max_body_size < static_cast<long>(_request._requestData.bodySize))
                         {
                             _request._errorCode = REQUEST_BODY_TOO_LARGE;
                             return true;
                         }
-                        if (!isPathValid())
+                        // a fastcgi_pass script lives with the application, not necessarily on this disk
+                        if (_request._location->type != FASTCGI && !isPathValid())
                         {
                             _request._errorCode = NOT_FOUND;
                             return true;
@@ -97,7 +94,7 @@ bool Request::RequestValidator::validate() const
                             _request._errorCode = HTTP_VERSION_NOT_SUPPORTED;
                             return true;
                         }
-                        if (!isReadOk())
+                        if (_request._location->type != FASTCGI && !isReadOk())
                         {
                             _request._errorCode = FORBIDDEN;
                             return true;
@@ -107,7 +104,7 @@ bool Request::RequestValidator::validate() const
                             _request._errorCode = BAD_REQUEST;
                             return true;
                         }
-                        if (!isServerFull())
+                        if (_request._location->type != FASTCGI && !isServerFull())
                         {
                             _request._errorCode = INSUFFICIENT_STORAGE;
                             return true;
@@ -193,7 +190,7 @@ bool Request::RequestValidator::checkForIndexing(std::string& fullPath) const
 {
     try
     {
-        if (std::filesystem::is_directory(fullPath))
+        if (_request._fileCache->lookup(fullPath).isDirectory)
         {
             if (_request._location->autoIndexOn)
             {
@@ -206,7 +203,7 @@ bool Request::RequestValidator::checkForIndexing(std::string& fullPath) const
                 {
                     std::string indexPath = fullPath + "/" + indexFile;
 
-                    if (std::filesystem::exists(indexPath))
+                    if (_request._fileCache->lookup(indexPath).exists)
                     {
                         fullPath = indexPath;
                         indexFound = true;
@@ -241,11 +238,11 @@ bool Request::RequestValidator::isPathValid() const
             if (!relativeUri.empty() && relativeUri.front() != '/')
                 relativeUri = "/" + relativeUri;
             std::string fullPath = _request._location->target + relativeUri;
-            fullPath = std::filesystem::absolute(fullPath).generic_string();
             if (!checkForIndexing(fullPath))
                 return false;
-            _request._requestData.uri = fullPath;
-            return std::filesystem::exists(fullPath);
+            const FileInfo fileInfo = _request._fileCache->lookup(fullPath);
+            _request._requestData.uri = fileInfo.absolutePath;
+            return fileInfo.exists;
         };
 
         auto handleRoot = [&]() -> bool {
@@ -256,9 +253,9 @@ bool Request::RequestValidator::isPathValid() const
             std::string fullPath = _request._location->root + _request._location->uri + relativeUri;
             if (!checkForIndexing(fullPath))
                 return false;
-            fullPath = std::filesystem::absolute(fullPath).generic_string();
-            _request._requestData.uri = fullPath;
-            return std::filesystem::exists(fullPath);
+            const FileInfo fileInfo = _request._fileCache->lookup(fullPath);
+            _request._requestData.uri = fileInfo.absolutePath;
+            return fileInfo.exists;
         };
 
         auto handleCGIPass = [&]() -> bool {
@@ -365,15 +362,6 @@ bool Request::RequestValidator::matchLocationSetData(const Server& server) const
 
         _request._location = bestMatchLocation;
 
-        if (bestMatchLocation->type == PROXY)
-        {
-            auto it = _proxyInfoMap.find(bestMatchLocation->target);
-            if (it != _proxyInfoMap.end())
-            {
-                _request._proxyInfo = it->second;
-            }
-        }
-
         return true;
     }
     catch (const std::exception& e)
@@ -4,6 +4,9 @@
 #include "WebErrors.hpp"
 #include "WebParser.hpp"
 #include "WebServer.hpp"
+#include "WorkerPool.hpp"
+#include <algorithm>
+#include <cstdlib>
 #include <fcntl.h>
 
 CGIHandler::CGIHandler(const Request& request, WebServer &webServer) : _webServer(webServer), _request(request), _response(""), _scriptPath(_request.getRequestData().uri)
@@ -23,23 +26,29 @@ void CGIHandler::executeScript(void)
             ErrorHandler(_request.getServer()).handleError(_response, 500);
             return WebErrors::printerror("CGIHandler::executeScript", "Error accessing script file") , void();
         }
-        if (pipe(_fromCgi_pipe) == -1 || pipe(_toCgi_pipe) == -1)
+        // close-on-exec, so the script only keeps the ends it is given as stdin and stdout
+        if (pipe2(_fromCgi_pipe, O_CLOEXEC) == -1)
         {
             ErrorHandler(_request.getServer()).handleError(_response, 500);
             return WebErrors::printerror("CGIHandler::executeScript", "Error creating pipes") , void();
         }
+        if (pipe2(_toCgi_pipe, O_CLOEXEC) == -1)
+        {
+            close(_fromCgi_pipe[READEND]);
+            close(_fromCgi_pipe[WRITEND]);
+            ErrorHandler(_request.getServer()).handleError(_response, 500);
+            return WebErrors::printerror("CGIHandler::executeScript", "Error creating pipes") , void();
+        }
         WebServer::setFdNonBlocking(_fromCgi_pipe[READEND]);
-        WebServer::setFdNonBlocking(_fromCgi_pipe[WRITEND]);
-        pid = fork();
+        pid = spawnScript();
         if (pid < 0)
         {
+            for (int fd : {_fromCgi_pipe[READEND], _fromCgi_pipe[WRITEND], _toCgi_pipe[READEND], _toCgi_pipe[WRITEND]})
+                close(fd);
             ErrorHandler(_request.getServer()).handleError(_response, 500);
-            return WebErrors::printerror("CGIHandler::executeScript", "Error forking process") , void();
+            return ;
         }
-        else if (pid == 0)
-            child();
-        else
-            parent(pid);
+        parent(pid);
         std::cout << COLOR_YELLOW_CGI << "  CGI Script Started 🐍\n\n" << COLOR_RESET;
     }
     catch (const std::exception &e)
@@ -49,117 +58,139 @@ void CGIHandler::executeScript(void)
     }
 }
 
-void CGIHandler::child(void)
+/* posix_spawn instead of fork: the child shares the server's memory until it execs (glibc clones with
+   CLONE_VM | CLONE_VFORK), so starting a script costs the same however large the caches have grown.
+   Everything the child needs is prepared here beforehand: argv, the environment and the fd actions.
+   Returns -1 if the interpreter could not be started */
+pid_t CGIHandler::spawnScript(void)
 {
-    try
+    const std::string               &interpreter = _request.getLocation()->cgi_interpreter;
+    const std::shared_ptr<OpenFile> &bodyFile = _request.getRequestData().bodyFile;
+    const size_t                    lastSlashPos = _scriptPath.find_last_of('/');
+    const std::string               scriptDir = lastSlashPos != std::string::npos ? _scriptPath.substr(0, lastSlashPos) : ".";
+    const std::vector<std::string>  env = buildEnvironment(_request, _scriptPath);
+    std::vector<char *>             envp;
+    char *const                     argv[] = { const_cast<char *>(interpreter.c_str()), const_cast<char *>(_scriptPath.c_str()), NULL };
+    posix_spawn_file_actions_t      actions;
+    posix_spawnattr_t               attributes;
+    sigset_t                        signals;
+    pid_t                           pid = -1;
+
+    for (const std::string &variable : env)
+        envp.push_back(const_cast<char *>(variable.c_str()));
+    envp.push_back(NULL);
+
+    posix_spawn_file_actions_init(&actions);
+    if (bodyFile) // a body spilled to disk is read by the script straight from the file
     {
-        size_t      lastSlashPos = _scriptPath.find_last_of('/');
-        std::string scriptDir;
-
-        if (lastSlashPos != std::string::npos)
-            scriptDir = _scriptPath.substr(0, lastSlashPos);
-        else
-            scriptDir = ".";
-        if (chdir(scriptDir.c_str()) != 0)
-        {
-            std::cout << WebParser::getErrorPage(500, _request.getServer());
-            exit(EXIT_FAILURE);
-        }
-        char const *argv[] = {PYTHON3, _scriptPath.c_str(), NULL};
-        char const *envp[9];
-
-        close(_toCgi_pipe[WRITEND]);
-        dup2(_toCgi_pipe[READEND], STDIN_FILENO);
-        close(_toCgi_pipe[READEND]);
-
-        close(_fromCgi_pipe[READEND]);
-        dup2(_fromCgi_pipe[WRITEND], STDOUT_FILENO);
-        dup2(_fromCgi_pipe[WRITEND], STDERR_FILENO);
-        close(_fromCgi_pipe[WRITEND]);
-
-        childSetEnvp(envp);
-        execve(PYTHON3, (char *const *)argv, (char *const *)envp);
-
-        WebErrors::printerror("CGIHandler::child", "Error executing script");
-        std::cout << WebParser::getErrorPage(500, _request.getServer());
-        std::terminate();
+        lseek(bodyFile->fd, 0, SEEK_SET);
+        posix_spawn_file_actions_adddup2(&actions, bodyFile->fd, STDIN_FILENO);
     }
-    catch (const std::exception &e)
+    else
+        posix_spawn_file_actions_adddup2(&actions, _toCgi_pipe[READEND], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, _fromCgi_pipe[WRITEND], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, _fromCgi_pipe[WRITEND], STDERR_FILENO);
+    posix_spawn_file_actions_addclosefrom_np(&actions, STDERR_FILENO + 1); // in case an fd of the server lacks O_CLOEXEC
+    posix_spawn_file_actions_addchdir_np(&actions, scriptDir.c_str());
+
+    // the server ignores SIGPIPE, the script should not inherit that, nor the mask of the worker thread
+    posix_spawnattr_init(&attributes);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+    sigemptyset(&signals);
+    posix_spawnattr_setsigmask(&attributes, &signals);
+    sigaddset(&signals, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attributes, &signals);
+
+    const int error = posix_spawn(&pid, interpreter.c_str(), &actions, &attributes, argv, envp.data());
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attributes);
+    if (error != 0)
     {
-        ErrorHandler(_request.getServer()).handleError(_response, 500);
-        std::cout << _response << std::endl;
-        exit(EXIT_FAILURE);
+        WebErrors::printerror("CGIHandler::spawnScript", "Error starting " + interpreter + ": " + strerror(error));
+        return -1;
     }
+    WorkerPool::releaseCpu(pid);
+    return pid;
 }
 
-
+/* A body kept in memory is written by the event loop as the script reads it (WebServer::writeCgiInput), through
+   a pipe enlarged to fit it when possible. The script sees end of input once it has all been written.
+   If the job can't be set up, the script is killed and reaped, and every pipe end still open here is closed */
 void CGIHandler::parent(pid_t pid)
 {
     try
     {
-        CGIProcessInfo cgiInfo;
+        CGIProcessInfo      cgiInfo;
+        const RequestData   &data = _request.getRequestData();
 
         cgiInfo.pid = pid;
         cgiInfo.clientSocket = _webServer.getCurrentEventFd();
         cgiInfo.response = "";
         cgiInfo.startTime = std::chrono::steady_clock::now();
         cgiInfo.readFromCgiFd = _fromCgi_pipe[READEND];
-        cgiInfo.writeToCgiFd = _toCgi_pipe[WRITEND];
-        if (_request.getRequestData().method == "POST" && !_request.getRequestData().body.empty())
+        cgiInfo.writeToCgiFd = -1;
+        cgiInfo.stream = CGIStream(data.method == "HEAD");
+        for (int *fd : {&_toCgi_pipe[READEND], &_fromCgi_pipe[WRITEND]}) // the script's ends
         {
-            const size_t bodySize = _request.getRequestData().body.size();
-            const ssize_t written = write(_toCgi_pipe[WRITEND], _request.getRequestData().body.c_str(), bodySize);
-            if (written == -1)
-                throw std::runtime_error("Failed to write to CGI script");
-            else if (written == 0)
-                throw std::runtime_error("Zero bytes written to CGI");
+            close(*fd);
+            *fd = -1;
+        }
+        if (!data.bodyFile && !data.body.empty())
+        {
+            if (fcntl(_toCgi_pipe[WRITEND], F_GETPIPE_SZ) < static_cast<int>(data.body.size()))
+                fcntl(_toCgi_pipe[WRITEND], F_SETPIPE_SZ, std::min(data.body.size(), static_cast<size_t>(CGI_INPUT_PIPE_SIZE)));
+            WebServer::setFdNonBlocking(_toCgi_pipe[WRITEND]);
+            cgiInfo.writeToCgiFd = _toCgi_pipe[WRITEND];
         }
         else
+        {
             close(_toCgi_pipe[WRITEND]);
-        _webServer.getCgiInfoList().push_back(cgiInfo);
-        _webServer.epollController(_fromCgi_pipe[READEND], EPOLL_CTL_ADD, EPOLLIN, FdType::CGI_PIPE);
-        close(_toCgi_pipe[READEND]);
-        close(_fromCgi_pipe[WRITEND]);
+            _toCgi_pipe[WRITEND] = -1;
+        }
+        _webServer.registerCgiProcess(cgiInfo);
     }
     catch (const std::exception &e)
     {
+        WebErrors::printerror("CGIHandler::parent", e.what());
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+        for (int fd : {_fromCgi_pipe[READEND], _fromCgi_pipe[WRITEND], _toCgi_pipe[READEND], _toCgi_pipe[WRITEND]})
+        {
+            if (fd != -1)
+                close(fd);
+        }
         ErrorHandler(_request.getServer()).handleError(_response, 500);
     }
 }
 
 
-void CGIHandler::childSetEnvp(char const *envp[])
+/* Also used for the requests handed to a cgi_pool worker */
+std::vector<std::string> CGIHandler::buildEnvironment(const Request &request, const std::string &scriptPath)
 {
-    try
-    {
-        static std::vector<std::string> env(9);
-        const RequestData *reqData =    &_request.getRequestData();
-
-        env[0] = "REQUEST_METHOD=" + reqData->method;
-        env[1] = "QUERY_STRING=" + reqData->query_string;
-        env[2] = "CONTENT_TYPE=" + reqData->content_type;
-        env[3] = "CONTENT_LENGTH=" + reqData->content_length;
-        env[4] = "DOCUMENT_ROOT=" + reqData->absoluteRootPath;
-        env[5] = "SCRIPT_FILENAME=" + _scriptPath;
-        env[6] = "SCRIPT_NAME=" + _scriptPath;
-        env[7] = "REDIRECT_STATUS=200";
-        env[8] = "UPLOAD_FOLDER="  + _request.getLocation()->upload_folder;
-
-        envp[0] = env[0].c_str();
-        envp[1] = env[1].c_str();
-        envp[2] = env[2].c_str();
-        envp[3] = env[3].c_str();
-        envp[4] = env[4].c_str();
-        envp[5] = env[5].c_str();
-        envp[6] = env[6].c_str();
-        envp[7] = env[7].c_str();
-        envp[8] = env[8].c_str();
-        envp[9] = NULL;
-    }
-    catch (const std::exception &e)
-    {
-        ErrorHandler(_request.getServer()).handleError(_response, 500);
-        std::cout <<  _response << std::endl;
-        exit(EXIT_FAILURE);
-    }
+    const RequestData *reqData = &request.getRequestData();
+
+    return {
+        "REQUEST_METHOD=" + reqData->method,
+        "QUERY_STRING=" + reqData->query_string,
+        "CONTENT_TYPE=" + reqData->content_type,
+        "CONTENT_LENGTH=" + reqData->content_length,
+        "DOCUMENT_ROOT=" + reqData->absoluteRootPath,
+        "SCRIPT_FILENAME=" + scriptPath,
+        "SCRIPT_NAME=" + scriptPath,
+        "REDIRECT_STATUS=200",
+        "UPLOAD_FOLDER=" + request.getLocation()->upload_folder,
+        pathVariable(),
+    };
+}
+
+/* The server's own PATH, so a script can run the programs it could (the CGI variables alone have none) */
+std::string CGIHandler::pathVariable(void)
+{
+    const char *path = std::getenv("PATH");
+
+    return std::string("PATH=") + (path ? path : CGI_DEFAULT_PATH);
 }
+
+/* Empty while the script runs, holds an error response if it could not be started */
+std::string CGIHandler::getCGIResponse(void) const { return _response; }
@@ -19,6 +19,7 @@
 #include <cstring>
 #include <ctime>
 #include <sys/wait.h>
+#include <spawn.h>
 #include "Request.hpp"
 #include "WebServer.hpp"
 
@@ -27,9 +28,10 @@
 #define READEND 0
 #define CODE404 "404"
 #define CODE500 "500"
-#define PYTHON3 "/bin/python3"
 #define ERROR "\033[31ERROR: \033[0"
 #define CGI_TIMEOUT_LIMIT 5
+#define CGI_INPUT_PIPE_SIZE (1024 * 1024)   // the most a body kept in memory can be (client_body_buffer_size)
+#define CGI_DEFAULT_PATH "/usr/local/bin:/usr/bin:/bin"    // if the server itself runs without a PATH
 
 class   CGIHandler
 {
@@ -38,6 +40,9 @@ class   CGIHandler
         ~CGIHandler() = default;
 
         std::string      getCGIResponse( void ) const;
+
+        static std::vector<std::string> buildEnvironment( const Request &request, const std::string &scriptPath );
+        static std::string              pathVariable( void );
     private:
         WebServer       &_webServer;
         const Request&   _request;
@@ -49,7 +54,6 @@ class   CGIHandler
         bool            validateExecutable( void );
         bool            parentWaitForChild(pid_t pid);
         void            executeScript( void );
-        void            child( void );
+        pid_t           spawnScript( void );
         void            parent( pid_t pid );
-        void            childSetEnvp( char const *envp[] );
 };
@@ -0,0 +1,151 @@
+#include "CGIStream.hpp"
+#include "WebErrors.hpp"
+#include "WebParser.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <strings.h>
+
+CGIStream::CGIStream(bool headRequest) : _headRequest(headRequest) {}
+
+/* The header lines are gathered until the blank line after them (CRLF or LF), what follows is body.
+   Throws if the script's head is invalid or too large */
+void CGIStream::append(const char *data, size_t length)
+{
+    if (_headDone)
+        return appendBody(data, length);
+
+    _head.append(data, length);
+
+    size_t          headEnd = _head.find("\r\n\r\n");
+    size_t          separatorSize = 4;
+    const size_t    lfHeadEnd = _head.find("\n\n");
+
+    if (lfHeadEnd != std::string::npos && lfHeadEnd < headEnd)
+    {
+        headEnd = lfHeadEnd;
+        separatorSize = 2;
+    }
+    if (headEnd != std::string::npos)
+        return buildHead(headEnd, separatorSize);
+    if (_head.length() > CGI_MAX_HEAD_SIZE)
+        throw WebErrors::BaseException("CGI response head is too large");
+}
+
+void CGIStream::append(const std::string &data) { append(data.data(), data.length()); }
+
+/* The script is done: ends the chunked body. Throws if the response it gave is not whole */
+void CGIStream::finish(void)
+{
+    if (!_headDone)
+        throw WebErrors::BaseException("CGI script ended without a response head");
+    if (!_bodyless && _bodyRemaining > 0)
+        throw WebErrors::BaseException("CGI script sent less than its Content-Length");
+    if (!_bodyless && _chunked)
+        _output += "0\r\n\r\n";
+}
+
+/* What has been converted so far, nothing until the head is complete */
+std::string CGIStream::take(void)
+{
+    std::string output;
+
+    output.swap(_output);
+    _forwarded = _forwarded || !output.empty();
+    return output;
+}
+
+bool CGIStream::hasHead(void) const { return _headDone; }
+
+bool CGIStream::hasForwarded(void) const { return _forwarded; }
+
+size_t CGIStream::pendingSize(void) const { return _output.length(); }
+
+/* Transfer-Encoding is the server's business, the script's is replaced. Its Connection header is kept for
+   the server to honour and rewrite */
+void CGIStream::buildHead(size_t headSize, size_t separatorSize)
+{
+    const std::string   body = _head.substr(headSize + separatorSize);
+    std::string         status;
+    std::string         contentLength;
+    std::string         headers;
+    bool                location = false;
+    size_t              lineStart = 0;
+
+    if (_head.compare(0, 5, "HTTP/") == 0) // a whole response, as nph scripts write it
+    {
+        const size_t lineEnd = std::min(_head.find('\n'), headSize);
+        const size_t statusStart = _head.find(' ');
+
+        if (statusStart < lineEnd)
+            status = WebParser::trimSpaces(_head.substr(statusStart + 1, lineEnd - statusStart - 1));
+        lineStart = lineEnd + 1;
+    }
+    while (lineStart < headSize)
+    {
+        const size_t    lineEnd = std::min(_head.find('\n', lineStart), headSize);
+        std::string     line = _head.substr(lineStart, lineEnd - lineStart);
+        const size_t    colonPos = line.find(':');
+
+        lineStart = lineEnd + 1;
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (colonPos == std::string::npos || colonPos == 0)
+            throw WebErrors::BaseException("CGI script sent an invalid header line");
+
+        const std::string name = line.substr(0, colonPos);
+        const std::string value = WebParser::trimSpaces(line.substr(colonPos + 1));
+
+        if (strcasecmp(name.c_str(), "Status") == 0)
+            status = value;
+        else if (strcasecmp(name.c_str(), "Content-Length") == 0)
+            contentLength = value;
+        else if (strcasecmp(name.c_str(), "Transfer-Encoding") != 0)
+        {
+            location = location || strcasecmp(name.c_str(), "Location") == 0;
+            headers += name + ": " + value + "\r\n";
+        }
+    }
+    if (status.empty())
+        status = location ? "302 Found" : "200 OK";
+
+    const int code = std::atoi(status.c_str());
+
+    if (code < 200 || code > 999)
+        throw WebErrors::BaseException("CGI script sent an invalid status");
+    _bodyless = _headRequest || code == 204 || code == 304;
+    if (!contentLength.empty() && contentLength.length() < 19 && contentLength.find_first_not_of("0123456789") == std::string::npos)
+    {
+        _bodyRemaining = std::stol(contentLength);
+        headers += "Content-Length: " + contentLength + "\r\n";
+    }
+    else if (code != 204 && code != 304)
+    {
+        _chunked = true;
+        headers += "Transfer-Encoding: chunked\r\n";
+    }
+    _output = "HTTP/1.1 " + status + "\r\n" + headers + "\r\n";
+    _headDone = true;
+    _head.clear();
+    appendBody(body.data(), body.length());
+}
+
+/* Anything past the Content-Length the script announced is dropped */
+void CGIStream::appendBody(const char *data, size_t length)
+{
+    if (_bodyless || length == 0)
+        return;
+    if (_chunked)
+    {
+        char sizeLine[24];
+
+        std::snprintf(sizeLine, sizeof(sizeLine), "%zx\r\n", length);
+        _output += sizeLine;
+        _output.append(data, length);
+        _output += "\r\n";
+        return;
+    }
+    length = std::min(length, static_cast<size_t>(_bodyRemaining));
+    _output.append(data, length);
+    _bodyRemaining -= length;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <string>
+
+#define CGI_MAX_HEAD_SIZE 65536    // as much as a request's header section (MAX_HEADER_SECTION_SIZE)
+
+/* Turns what a script writes (cgi_pass, cgi_pool or a FastCGI application's STDOUT) into an HTTP/1.1 response
+   while it is still coming. The script may start with a status line or with CGI headers only (Status: gives the
+   status, a Location: without it makes a 302), its lines may end in LF. The body keeps the Content-Length the
+   script gave, otherwise it is sent in chunks, so nothing has to wait for the script to end */
+class CGIStream
+{
+public:
+    explicit CGIStream(bool headRequest = false);
+
+    void        append(const char *data, size_t length);
+    void        append(const std::string &data);
+    void        finish(void);
+    std::string take(void);
+    bool        hasHead(void) const;
+    bool        hasForwarded(void) const;
+    size_t      pendingSize(void) const;
+
+private:
+    bool        _headRequest;
+    std::string _head;                  // the script's header lines, until the blank line after them
+    bool        _headDone = false;
+    bool        _chunked = false;
+    bool        _bodyless = false;      // HEAD request, 204 or 304: the body is dropped
+    long        _bodyRemaining = -1;    // with a Content-Length, what is still to come
+    std::string _output;                // converted and not taken yet
+    bool        _forwarded = false;
+
+    void        buildHead(size_t headSize, size_t separatorSize);
+    void        appendBody(const char *data, size_t length);
+};
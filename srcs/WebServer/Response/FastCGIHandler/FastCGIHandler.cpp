@@ -0,0 +1,258 @@
+#include "FastCGIHandler.hpp"
+#include "WebErrors.hpp"
+#include "WebParser.hpp"
+#include "WebServer.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <filesystem>
+#include <iostream>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+FastCGIHandler::FastCGIHandler(const Request& req, int clientSocket, UpstreamPool &pool, const addrinfo *upstreamInfo, const std::string &upstream)
+    : UpstreamHandler(req, clientSocket, pool, upstreamInfo, upstream), _stream(req.getRequestData().method == "HEAD")
+{
+    const char beginRequest[8] = { 0, 1, static_cast<char>(_keepAlive ? 1 : 0), 0, 0, 0, 0, 0 }; // responder role
+
+    appendRecord(BEGIN_REQUEST, beginRequest, sizeof(beginRequest));
+    appendParams();
+}
+
+/* Moves the exchange on as far as the socket allows. DONE means the application ended the request,
+   FAILED that it could not be reached, broke off or did not speak FastCGI */
+FastCGIHandler::Status FastCGIHandler::handleEvent(uint32_t events, std::vector<char> &readBuffer, bool drain, size_t room)
+{
+    try
+    {
+        if (!isConnected(events))
+            return IN_PROGRESS;
+        if (_state == SENDING)
+        {
+            Status status = sendRequest();
+            if (status != DONE)
+                return status;
+            _state = RECEIVING;
+            return IN_PROGRESS;
+        }
+        return receiveResponse(readBuffer, drain, room);
+    }
+    catch (const std::exception &e)
+    {
+        WebErrors::printerror("FastCGIHandler::handleEvent", e.what());
+        return FAILED;
+    }
+}
+
+/* The records queued so far, then the body a STDIN record at a time, so a large body is never copied whole */
+FastCGIHandler::Status FastCGIHandler::sendRequest()
+{
+    while (true)
+    {
+        if (_outputSent == _output.length())
+        {
+            if (_inputClosed)
+                return DONE;
+            queueStdin();
+        }
+
+        ssize_t bytesSent = send(_socket->getFd(), _output.data() + _outputSent, _output.length() - _outputSent, MSG_NOSIGNAL);
+
+        if (bytesSent == -1 && errno == EINTR)
+            continue;
+        if (bytesSent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return IN_PROGRESS;
+        if (bytesSent <= 0)
+            throw WebErrors::ProxyException("Error sending request to FastCGI application");
+        _outputSent += bytesSent;
+    }
+}
+
+/* The next piece of the body, from memory or from the file it was spilled to, or the empty record that ends it */
+void FastCGIHandler::queueStdin()
+{
+    const RequestData   &data = _request.getRequestData();
+    size_t              length = std::min(data.bodySize - _bodyQueued, static_cast<size_t>(FASTCGI_MAX_RECORD_SIZE));
+
+    _output.clear();
+    _outputSent = 0;
+    if (length == 0)
+    {
+        appendRecord(STDIN, nullptr, 0);
+        _inputClosed = true;
+        return;
+    }
+    if (!data.bodyFile)
+        appendRecord(STDIN, data.body.data() + _bodyQueued, length);
+    else
+    {
+        std::string     piece(length, '\0');
+        const ssize_t   bytesRead = pread(data.bodyFile->fd, &piece[0], length, _bodyQueued);
+
+        if (bytesRead <= 0)
+            throw WebErrors::ProxyException("Error reading the request body");
+        length = bytesRead;
+        appendRecord(STDIN, piece.data(), length);
+    }
+    _bodyQueued += length;
+}
+
+/* Once the response head is out, at most `room` bytes of response wait to be taken */
+FastCGIHandler::Status FastCGIHandler::receiveResponse(std::vector<char> &readBuffer, bool drain, size_t room)
+{
+    while (true)
+    {
+        size_t wanted = readBuffer.size();
+
+        if (_stream.hasHead())
+        {
+            if (_stream.pendingSize() >= room)
+                return IN_PROGRESS;
+            wanted = std::min(wanted, room - _stream.pendingSize());
+        }
+
+        ssize_t bytesRead = recv(_socket->getFd(), readBuffer.data(), wanted, 0);
+
+        if (bytesRead > 0)
+        {
+            _received = true;
+            _input.append(readBuffer.data(), bytesRead);
+            if (parseRecords())
+            {
+                _requestsServed++;
+                return DONE;
+            }
+            if (!drain)
+                return IN_PROGRESS;
+        }
+        else if (bytesRead == 0)
+            throw WebErrors::ProxyException("FastCGI application closed the connection before ending the request");
+        else if (errno == EINTR)
+            continue;
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return IN_PROGRESS;
+        else
+            throw WebErrors::ProxyException("Error reading from FastCGI application");
+    }
+}
+
+/* Handles the complete records received so far. Returns true on the END_REQUEST of the request */
+bool FastCGIHandler::parseRecords()
+{
+    size_t pos = 0;
+
+    while (_input.length() - pos >= 8)
+    {
+        const unsigned char *header = reinterpret_cast<const unsigned char *>(_input.data() + pos);
+        const size_t        contentLength = (header[4] << 8) | header[5];
+        const size_t        recordLength = 8 + contentLength + header[6];
+        const char          *content = _input.data() + pos + 8;
+
+        if (header[0] != 1)
+            throw WebErrors::ProxyException("FastCGI application sent an invalid record");
+        if (_input.length() - pos < recordLength)
+            break;
+        pos += recordLength;
+        if (((header[2] << 8) | header[3]) != 1) // management records
+            continue;
+
+        if (header[1] == STDOUT) // throws on a head that doesn't end within CGI_MAX_HEAD_SIZE, the client gets a 502
+            _stream.append(content, contentLength);
+        else if (header[1] == STDERR && contentLength > 0)
+            std::cerr << COLOR_YELLOW_CGI << "  FastCGI: " << std::string(content, contentLength) << "\n" << COLOR_RESET;
+        else if (header[1] == END_REQUEST)
+        {
+            if (contentLength < 8 || content[4] != 0)
+                throw WebErrors::ProxyException("FastCGI application refused the request");
+            _stream.finish();
+            _reusable = _keepAlive && pos == _input.length();
+            _input.clear();
+            return true;
+        }
+    }
+    _input.erase(0, pos);
+    return false;
+}
+
+/* The same variables a cgi_pass script gets, plus what FastCGI applications usually look for, and the request
+   headers as HTTP_* */
+void FastCGIHandler::appendParams()
+{
+    const RequestData   &data = _request.getRequestData();
+    const Server        *server = _request.getServer();
+    const Location      *location = _request.getLocation();
+    const std::string   documentRoot = location->root.empty() ? "" : std::filesystem::absolute(location->root).lexically_normal().string();
+    std::string         params;
+
+    appendParam(params, "GATEWAY_INTERFACE", "CGI/1.1");
+    appendParam(params, "SERVER_SOFTWARE", "webserv");
+    appendParam(params, "SERVER_PROTOCOL", data.httpVersion);
+    appendParam(params, "SERVER_NAME", server->server_name.empty() ? "" : server->server_name[0]);
+    appendParam(params, "SERVER_PORT", std::to_string(server->port));
+    appendParam(params, "REQUEST_METHOD", data.method);
+    appendParam(params, "REQUEST_URI", data.query_string.empty() ? data.uri : data.uri + "?" + data.query_string);
+    appendParam(params, "QUERY_STRING", data.query_string);
+    appendParam(params, "SCRIPT_NAME", data.uri);
+    appendParam(params, "SCRIPT_FILENAME", documentRoot + data.uri);
+    appendParam(params, "DOCUMENT_ROOT", documentRoot);
+    appendParam(params, "CONTENT_TYPE", data.content_type);
+    appendParam(params, "CONTENT_LENGTH", data.bodySize > 0 ? std::to_string(data.bodySize) : "");
+    appendParam(params, "REDIRECT_STATUS", "200");
+    appendParam(params, "UPLOAD_FOLDER", location->upload_folder);
+    for (const auto &[name, value] : data.headers)
+    {
+        if (strcasecmp(name.c_str(), "Content-Type") == 0 || strcasecmp(name.c_str(), "Content-Length") == 0)
+            continue;
+
+        std::string variable = "HTTP_" + name;
+
+        std::transform(variable.begin(), variable.end(), variable.begin(),
+            [](unsigned char c) { return c == '-' ? '_' : std::toupper(c); });
+        appendParam(params, variable, value);
+    }
+
+    for (size_t pos = 0; pos < params.length(); pos += FASTCGI_MAX_RECORD_SIZE)
+        appendRecord(PARAMS, params.data() + pos, std::min(params.length() - pos, static_cast<size_t>(FASTCGI_MAX_RECORD_SIZE)));
+    appendRecord(PARAMS, nullptr, 0);
+}
+
+/* Every record is for request 1, a connection only ever carries one request at a time */
+void FastCGIHandler::appendRecord(RecordType type, const char *data, size_t length)
+{
+    const char header[8] = { 1, static_cast<char>(type), 0, 1,
+        static_cast<char>(length >> 8), static_cast<char>(length & 0xFF), 0, 0 };
+
+    _output.append(header, sizeof(header));
+    if (length > 0)
+        _output.append(data, length);
+}
+
+/* Lengths under 128 take one byte, longer ones four with the top bit set */
+void FastCGIHandler::appendParam(std::string &params, const std::string &name, const std::string &value)
+{
+    for (const std::string *field : { &name, &value })
+    {
+        const size_t length = field->length();
+
+        if (length < 128)
+            params += static_cast<char>(length);
+        else
+        {
+            params += static_cast<char>(((length >> 24) & 0x7F) | 0x80);
+            params += static_cast<char>((length >> 16) & 0xFF);
+            params += static_cast<char>((length >> 8) & 0xFF);
+            params += static_cast<char>(length & 0xFF);
+        }
+    }
+    params += name + value;
+}
+
+/* Everything converted since the last call, starting with the head. Empty as long as the head is incomplete */
+std::string FastCGIHandler::takeResponse()
+{
+    std::string response = _stream.take();
+
+    _forwarded = _forwarded || !response.empty();
+    return response;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "CGIStream.hpp"
+#include "UpstreamHandler.hpp"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#define FASTCGI_MAX_RECORD_SIZE 65535 // content bytes per record, the length field is 16 bits
+
+/* One request to a FastCGI application (the responder role), driven by epoll events like a proxied request.
+   The request goes out as records: BEGIN_REQUEST, the CGI variables as PARAMS, then the body as STDIN, read from
+   memory or from the spilled file a record at a time. What the application writes on STDOUT is a CGI response:
+   its headers become an HTTP head (Status: gives the status line), and its body is passed on as it arrives,
+   in chunks unless the application gave a Content-Length. END_REQUEST ends it, and the connection stays open
+   for the next request when the pool keeps connections (FCGI_KEEP_CONN) */
+class FastCGIHandler : public UpstreamHandler
+{
+public:
+    FastCGIHandler(const Request& request, int clientSocket, UpstreamPool &pool, const addrinfo *upstreamInfo, const std::string &upstream);
+    ~FastCGIHandler() = default;
+
+    Status          handleEvent(uint32_t events, std::vector<char> &readBuffer, bool drain, size_t room) override;
+    std::string     takeResponse() override;
+
+private:
+    enum RecordType { BEGIN_REQUEST = 1, END_REQUEST = 3, PARAMS = 4, STDIN = 5, STDOUT = 6, STDERR = 7 };
+
+    std::string     _output;                // records waiting to be sent
+    size_t          _outputSent = 0;
+    size_t          _bodyQueued = 0;        // body bytes already put in STDIN records
+    bool            _inputClosed = false;   // the empty STDIN record is queued
+    std::string     _input;                 // received bytes not parsed into records yet
+    CGIStream       _stream;                // STDOUT, turned into the HTTP response
+
+    Status          sendRequest();
+    void            queueStdin();
+    Status          receiveResponse(std::vector<char> &readBuffer, bool drain, size_t room);
+    bool            parseRecords();
+    void            appendParams();
+    void            appendRecord(RecordType type, const char *data, size_t length);
+    static void     appendParam(std::string &params, const std::string &name, const std::string &value);
+};
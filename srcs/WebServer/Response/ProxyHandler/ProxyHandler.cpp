@@ -1,42 +1,21 @@
 #include "ProxyHandler.hpp"
-#include "ProxySocket/ProxySocket.hpp"
 #include "WebErrors.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
 #include <cstring>
-#include <netinet/tcp.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <unistd.h>
 #include <iostream>
 
-ProxyHandler::ProxyHandler(const Request& req) : _request(req), _proxyInfo(req.getProxyInfo()), _proxyHost(req.getLocation()->target)
+/* The Host header is set to `upstream`, the host:port of the server picked for the request */
+ProxyHandler::ProxyHandler(const Request& req, int clientSocket, UpstreamPool &pool, const addrinfo *upstreamInfo, const std::string &upstream)
+    : UpstreamHandler(req, clientSocket, pool, upstreamInfo, upstream)
 {
-    if (!_proxyInfo) throw WebErrors::ProxyException("No proxy information available");
-}
-
-bool ProxyHandler::isDataAvailable(int fd, int timeout_usec)
-{
-    if (fd < 0)
-        throw WebErrors::ProxyException("Invalid file descriptor.");
-    try
-    {
-        struct timeval timeout;
-        timeout.tv_sec = timeout_usec / 1000000;
-        timeout.tv_usec = timeout_usec % 1000000;
-
-        fd_set readfds;
-        FD_ZERO(&readfds);
-        FD_SET(fd, &readfds);
-
-        int ret = select(fd + 1, &readfds, nullptr, nullptr, &timeout);
-
-        if (ret < 0) {
-            throw WebErrors::ProxyException("Error with select on proxy server socket");
-        }
-        return ret > 0 && FD_ISSET(fd, &readfds);
-    }
-    catch (const std::exception &e)
-    {
-        WebErrors::printerror("ProxyHandler::isDataAvailable", e.what());
-        throw;
-    }
+    _head = modifyRequestForProxy();
 }
 
 std::string ProxyHandler::modifyRequestForProxy()
@@ -60,15 +39,34 @@ std::string ProxyHandler::modifyRequestForProxy()
             size_t uriPos = modifiedRequest.find(locationUri);
             if (uriPos != std::string::npos && locationUri != "/")
             {
-                std::string newUri = modifiedRequest.substr(uriPos + locationUri.length());
+                const size_t uriEnd = modifiedRequest.find(" ", uriPos);
+                std::string newUri = modifiedRequest.substr(uriPos + locationUri.length(), uriEnd - uriPos - locationUri.length());
                 if (newUri.empty() || newUri[0] != '/')
                     newUri = "/" + newUri;
-                modifiedRequest.replace(uriPos, modifiedRequest.find(" ", uriPos) - uriPos, newUri);
+                modifiedRequest.replace(uriPos, uriEnd - uriPos, newUri);
+            }
+        };
+
+        // The body has already arrived in full, so an Expect: 100-continue would only get an interim response back
+        auto rewriteConnectionHeaders = [&]() {
+            size_t lineStart = modifiedRequest.find('\n') + 1;
+            while (lineStart < modifiedRequest.length())
+            {
+                size_t lineEnd = modifiedRequest.find('\n', lineStart);
+                if (lineEnd == std::string::npos || lineEnd == lineStart || (lineEnd == lineStart + 1 && modifiedRequest[lineStart] == '\r'))
+                    break;
+                if (strncasecmp(modifiedRequest.c_str() + lineStart, "Connection:", 11) == 0
+                    || strncasecmp(modifiedRequest.c_str() + lineStart, "Expect:", 7) == 0)
+                    modifiedRequest.erase(lineStart, lineEnd + 1 - lineStart);
+                else
+                    lineStart = lineEnd + 1;
             }
+            modifiedRequest.insert(lineStart, _keepAlive ? "Connection: keep-alive\r\n" : "Connection: close\r\n");
         };
 
         replaceHostHeader(_proxyHost);
         modifyUri();
+        rewriteConnectionHeaders();
 
         return modifiedRequest;
     }
@@ -78,36 +76,274 @@ std::string ProxyHandler::modifyRequestForProxy()
     }
 }
 
-void ProxyHandler::passRequest(std::string &response)
+/* Moves the exchange on as far as the socket allows, reading at most `room` bytes of response that have not been
+   taken yet. DONE means the whole response has been received, FAILED that the upstream could not be reached
+   or broke off */
+ProxyHandler::Status ProxyHandler::handleEvent(uint32_t events, std::vector<char> &readBuffer, bool drain, size_t room)
+{
+    try
+    {
+        if (!isConnected(events))
+            return IN_PROGRESS;
+        if (_state == SENDING)
+        {
+            Status status = sendRequest();
+            if (status != DONE)
+                return status;
+            _state = RECEIVING;
+            return IN_PROGRESS;
+        }
+        return receiveResponse(readBuffer, drain, room);
+    }
+    catch (const std::exception &e)
+    {
+        WebErrors::printerror("ProxyHandler::handleEvent", e.what());
+        return FAILED;
+    }
+}
+
+/* The head first, then the body from memory, or with sendfile() when it was spilled to disk */
+ProxyHandler::Status ProxyHandler::sendRequest()
+{
+    const RequestData   &data = _request.getRequestData();
+
+    while (_headSent < _head.length() || _bodySent < data.bodySize)
+    {
+        ssize_t bytesSent;
+
+        if (_headSent < _head.length())
+            bytesSent = send(_socket->getFd(), _head.data() + _headSent, _head.length() - _headSent, MSG_NOSIGNAL);
+        else if (!data.bodyFile)
+            bytesSent = send(_socket->getFd(), data.body.data() + _bodySent, data.bodySize - _bodySent, MSG_NOSIGNAL);
+        else
+        {
+            off_t offset = _bodySent;
+            bytesSent = sendfile(_socket->getFd(), data.bodyFile->fd, &offset, data.bodySize - _bodySent);
+        }
+
+        if (bytesSent == -1 && errno == EINTR)
+            continue;
+        if (bytesSent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return IN_PROGRESS;
+        if (bytesSent <= 0)
+            throw WebErrors::ProxyException("Error sending request to proxy server");
+        if (_headSent < _head.length())
+            _headSent += bytesSent;
+        else
+            _bodySent += bytesSent;
+    }
+    return DONE;
+}
+
+/* The head is gathered whole, whatever `room` says, so that it can be looked at before anything is forwarded */
+ProxyHandler::Status ProxyHandler::receiveResponse(std::vector<char> &readBuffer, bool drain, size_t room)
 {
-    try {
-        ProxySocket proxySocket(_proxyInfo, _proxyHost);
-        std::string modifiedRequest = modifyRequestForProxy();
-        char        buffer[8192];
-        ssize_t     bytesRead = 0;
-        ssize_t     bytesSent = 0;
-
-        bytesSent = send(proxySocket.getFd(), modifiedRequest.c_str(), modifiedRequest.length(), 0);
-        if (bytesSent == 0)
-            throw WebErrors::ProxyException("Error sending to proxy server, connection was closed by proxy server");
-        else if (bytesSent < 0)
-            throw WebErrors::ProxyException("Error sending to proxy server");
-
-        while (isDataAvailable(proxySocket.getFd(), 20000)) // 2ms timeout
+    while (true)
+    {
+        size_t wanted = readBuffer.size();
+
+        if (_responseHeadSize > 0)
+        {
+            if (_response.length() >= room)
+                return IN_PROGRESS;
+            wanted = std::min(wanted, room - _response.length());
+        }
+
+        ssize_t bytesRead = recv(_socket->getFd(), readBuffer.data(), wanted, 0);
+
+        if (bytesRead > 0)
         {
-            bytesRead = recv(proxySocket.getFd(), buffer, sizeof(buffer), 0);
-            if (bytesRead > 0)
+            size_t newBodyBytes = bytesRead;
+
+            _received = true;
+            _response.append(readBuffer.data(), bytesRead);
+            if (_responseHeadSize == 0)
+            {
+                if (!findResponseHead())
+                    continue;
+                newBodyBytes = _response.length() - _responseHeadSize;
+            }
+            if (isBodyComplete(newBodyBytes))
             {
-                response.append(buffer, bytesRead);
+                _requestsServed++;
+                return DONE;
             }
-            else if (bytesRead == 0)
-                break;
-            else if (bytesRead < 0)
-                throw WebErrors::ProxyException("Error reading from proxy server");
+            if (!drain)
+                return IN_PROGRESS;
         }
+        else if (bytesRead == 0)
+        {
+            if (_responseHeadSize == 0 && _response.empty())
+                throw WebErrors::ProxyException("Proxy server closed the connection without responding");
+            if (_responseHeadSize == 0 || _responseBodySize >= 0 || _chunked)
+                throw WebErrors::ProxyException("Proxy server closed the connection before the end of the response");
+            _reusable = false;
+            return DONE;
+        }
+        else if (errno == EINTR)
+            continue;
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return IN_PROGRESS;
+        else
+            throw WebErrors::ProxyException("Error reading from proxy server");
     }
-    catch (const std::exception &e)
+}
+
+/* Looks for the end of the final response head, dropping the interim responses in front of it */
+bool ProxyHandler::findResponseHead()
+{
+    while (true)
+    {
+        const size_t headEnd = _response.find("\r\n\r\n");
+
+        if (headEnd == std::string::npos)
+        {
+            if (_response.length() > PROXY_MAX_HEAD_SIZE)
+                throw WebErrors::ProxyException("Proxy server response head is too large");
+            return false;
+        }
+        if (parseResponseHead(headEnd + 4))
+            return true;
+        _response.erase(0, headEnd + 4);
+    }
+}
+
+/* Works out where the response ends and whether the connection can serve another request afterwards.
+   Returns false for an interim response, which has no body and is followed by another head */
+bool ProxyHandler::parseResponseHead(size_t headSize)
+{
+    const std::string   head = _response.substr(0, headSize);
+    const std::string   version = head.substr(0, head.find(' '));
+    const size_t        statusPos = head.find(' ') + 1;
+    const int           status = std::atoi(head.c_str() + std::min(statusPos, head.length()));
+    std::string         contentLength;
+    std::string         transferEncoding;
+    std::string         connection;
+
+    if (version.compare(0, 5, "HTTP/") != 0 || status < 100 || status > 999)
+        throw WebErrors::ProxyException("Proxy server sent an invalid status line");
+    if (status < 200 && status != 101)
+        return false;
+
+    for (size_t lineStart = head.find('\n') + 1; lineStart < head.length(); )
     {
-        throw ;
+        const size_t        lineEnd = head.find('\n', lineStart);
+        const std::string   line = head.substr(lineStart, lineEnd - lineStart);
+        const size_t        colonPos = line.find(':');
+
+        if (colonPos == 14 && strncasecmp(line.c_str(), "Content-Length", colonPos) == 0)
+            contentLength = WebParser::trimSpaces(line.substr(colonPos + 1));
+        else if (colonPos == 10 && strncasecmp(line.c_str(), "Connection", colonPos) == 0)
+            connection = WebParser::trimSpaces(line.substr(colonPos + 1));
+        else if (colonPos == 17 && strncasecmp(line.c_str(), "Transfer-Encoding", colonPos) == 0)
+            transferEncoding = WebParser::trimSpaces(line.substr(colonPos + 1));
+        lineStart = lineEnd + 1;
     }
+
+    _responseHeadSize = headSize;
+    // Transfer-Encoding wins over Content-Length, and only a final "chunked" coding frames the body (RFC 9112 6.3)
+    const std::string lastCoding = WebParser::trimSpaces(transferEncoding.substr(transferEncoding.rfind(',') + 1));
+
+    if (_request.getRequestData().method == "HEAD" || status == 204 || status == 304)
+        _responseBodySize = 0;
+    else if (!transferEncoding.empty())
+        _chunked = strcasecmp(lastCoding.c_str(), "chunked") == 0;
+    else if (status >= 200 && !contentLength.empty() && contentLength.length() < 19
+        && contentLength.find_first_not_of("0123456789") == std::string::npos)
+        _responseBodySize = std::stol(contentLength);
+    if (strcasecmp(connection.c_str(), "close") == 0)
+        _reusable = false;
+    else
+        _reusable = _keepAlive && (_responseBodySize >= 0 || _chunked)
+            && (version == "HTTP/1.1" || strcasecmp(connection.c_str(), "keep-alive") == 0);
+    return true;
 }
+
+/* Checks the `newBytes` body bytes at the end of the response against its framing. Anything the upstream sent
+   past the end is cut off, and the connection is not trusted for another request */
+bool ProxyHandler::isBodyComplete(size_t newBytes)
+{
+    size_t used = newBytes;
+
+    if (_chunked)
+        used = scanChunkedBody(_response.data() + _response.length() - newBytes, newBytes);
+    else if (_responseBodySize >= 0)
+        used = std::min(newBytes, static_cast<size_t>(_responseBodySize) - _bodyReceived);
+    _bodyReceived += used;
+    if (used < newBytes)
+    {
+        _response.resize(_response.length() - (newBytes - used));
+        _reusable = false;
+    }
+    if (_chunked)
+        return _chunkState == CHUNK_DONE;
+    return _responseBodySize >= 0 && _bodyReceived == static_cast<size_t>(_responseBodySize);
+}
+
+/* Follows the chunk sizes, chunk ends and trailer of a chunked body without changing it, the client gets the
+   chunks as they are. Returns how many of the bytes belong to the body */
+size_t ProxyHandler::scanChunkedBody(const char *data, size_t length)
+{
+    size_t pos = 0;
+
+    while (pos < length && _chunkState != CHUNK_DONE)
+    {
+        if (_chunkState == CHUNK_DATA)
+        {
+            const size_t dataLength = std::min(length - pos, _chunkRemaining);
+
+            pos += dataLength;
+            _chunkRemaining -= dataLength;
+            if (_chunkRemaining == 0)
+                _chunkState = CHUNK_DATA_END;
+            continue;
+        }
+
+        const char      *newline = static_cast<const char *>(std::memchr(data + pos, '\n', length - pos));
+        const size_t    lineEnd = newline ? newline - data : length;
+
+        _chunkLine.append(data + pos, lineEnd - pos);
+        if (_chunkLine.length() > PROXY_MAX_CHUNK_LINE_SIZE)
+            throw WebErrors::ProxyException("Proxy server sent a chunk line that is too long");
+        pos = lineEnd;
+        if (!newline)
+            break;
+        pos++;
+        if (!_chunkLine.empty() && _chunkLine.back() == '\r')
+            _chunkLine.pop_back();
+
+        if (_chunkState == CHUNK_SIZE)
+        {
+            const std::string size = WebParser::trimSpaces(_chunkLine.substr(0, _chunkLine.find(';')));
+
+            if (size.empty() || size.length() > 15 || size.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos)
+                throw WebErrors::ProxyException("Proxy server sent an invalid chunk size");
+            _chunkRemaining = std::stoul(size, nullptr, 16);
+            _chunkState = _chunkRemaining == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+        }
+        else if (_chunkState == CHUNK_DATA_END)
+        {
+            if (!_chunkLine.empty())
+                throw WebErrors::ProxyException("Proxy server sent chunk data longer than its size");
+            _chunkState = CHUNK_SIZE;
+        }
+        else if (_chunkLine.empty())
+            _chunkState = CHUNK_DONE;
+        _chunkLine.clear();
+    }
+    return pos;
+}
+
+/* Everything received since the last call, starting with the head. Empty as long as the head is incomplete */
+std::string ProxyHandler::takeResponse()
+{
+    if (_responseHeadSize == 0)
+        return "";
+    std::string response;
+
+    response.swap(_response);
+    _forwarded = _forwarded || !response.empty();
+    return response;
+}
+
+bool ProxyHandler::hasResponseHead() const { return _responseHeadSize > 0; }
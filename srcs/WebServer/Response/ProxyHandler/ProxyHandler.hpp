@@ -1,21 +1,50 @@
 #pragma once
 
-#include "ScopedSocket.hpp"
-#include "Request.hpp"
+#include "UpstreamHandler.hpp"
+#include <cstdint>
 #include <string>
+#include <vector>
 
-class ProxyHandler
+#define PROXY_TIMEOUT_LIMIT 60 // seconds the upstream may stay silent, in any phase, before a 504
+#define PROXY_BUFFER_SIZE 262144 // bytes of response waiting for the client before the upstream stops being read
+#define PROXY_MAX_HEAD_SIZE 32768
+#define PROXY_MAX_CHUNK_LINE_SIZE 4096
+
+/* One proxied request, driven by epoll events on the upstream socket: a non-blocking connect (skipped when an
+   idle connection is taken from the pool), then the request is written as the socket accepts it, then the
+   response is read until its framing says it is complete: its Content-Length, its last chunk, or the upstream
+   closing the connection. Interim (1xx) responses are dropped. Once the head of the final response is complete,
+   the response is handed over piece by piece with takeResponse(), as it arrives, chunked framing included.
+   Nothing in here ever blocks */
+class ProxyHandler : public UpstreamHandler
 {
 public:
-    ProxyHandler(const Request& request);
+    ProxyHandler(const Request& request, int clientSocket, UpstreamPool &pool, const addrinfo *upstreamInfo, const std::string &upstream);
     ~ProxyHandler() = default;
-    void passRequest(std::string &response);
+
+    Status          handleEvent(uint32_t events, std::vector<char> &readBuffer, bool drain, size_t room) override;
+    std::string     takeResponse() override;
+    bool            hasResponseHead() const;
 
 private:
-    const Request&  _request;
-    addrinfo*       _proxyInfo;
-    std::string     _proxyHost;
-    void            sendRequestToProxy(ScopedSocket& proxySocket, const std::string& modifiedRequest);
-    bool            isDataAvailable(int fd, int timeout_usec);
+    enum ChunkState { CHUNK_SIZE, CHUNK_DATA, CHUNK_DATA_END, CHUNK_TRAILER, CHUNK_DONE };
+
+    std::string     _head;
+    size_t          _headSent = 0;
+    size_t          _bodySent = 0;
+    size_t          _responseHeadSize = 0;  // 0 until the whole head has arrived
+    long            _responseBodySize = -1; // -1 when the chunks or the upstream closing end the body
+    size_t          _bodyReceived = 0;
+    bool            _chunked = false;
+    ChunkState      _chunkState = CHUNK_SIZE;
+    size_t          _chunkRemaining = 0;
+    std::string     _chunkLine;             // a size or trailer line split between two reads
+
+    Status          sendRequest();
+    Status          receiveResponse(std::vector<char> &readBuffer, bool drain, size_t room);
+    bool            findResponseHead();
+    bool            parseResponseHead(size_t headSize);
+    bool            isBodyComplete(size_t newBytes);
+    size_t          scanChunkedBody(const char *data, size_t length);
     std::string     modifyRequestForProxy();
 };
@@ -1,7 +1,6 @@
 #include "Response.hpp"
 #include "CGIHandler/CGIHandler.hpp"
 #include "ErrorHandler/ErrorHandler.hpp"
-#include "ProxyHandler/ProxyHandler.hpp"
 #include "Request.hpp"
 #include "ScopedSocket.hpp"
 #include "WebErrors.hpp"
@@ -43,17 +42,14 @@ std::string Response::generate(const Request &request)
             response += "\r\n";
             return response;
         }
-        else if (request.getLocation()->type == LocationType::PROXY)
-        {
-            ProxyHandler(request).passRequest(response);
-        }
         else if (request.getLocation()->type == LocationType::STANDARD
             || request.getLocation()->type == LocationType::ALIAS)
         {
-            StaticFileHandler(request).serveFile(response);
+            StaticFileHandler(request).serveFile(response, _body);
         }
         if (request.getRequestData().method == "HEAD" && request.getErrorCode() == 0)
         {
+            _body = ResponseBody();
             size_t headerEndPos = response.find("\r\n\r\n");
             if (headerEndPos != std::string::npos)
                 response = response.substr(0, headerEndPos + 4);
@@ -72,3 +68,8 @@ const std::string &Response::getResponse() const
 {
     return _response;
 }
+
+ResponseBody Response::releaseBody()
+{
+    return std::move(_body);
+}
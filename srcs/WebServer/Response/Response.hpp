@@ -1,21 +1,35 @@
 #pragma once
 
 #include "ScopedSocket.hpp"
+#include "FileCache.hpp"
 #include <string>
 #include <netdb.h>
 
 class Request;
 
+/* A static file body kept out of the response string: either an open file sent with sendfile(),
+   or a buffer shared with the response cache. Either way it is never copied on its way to the socket */
+struct ResponseBody
+{
+    std::shared_ptr<OpenFile>           file;
+    std::shared_ptr<const std::string>  data;
+    size_t                              size = 0;
+};
+
 class Response
 {
 public:
     Response(const Request &request);
     ~Response() = default;
+    Response(const Response &) = delete;
+    Response &operator=(const Response &) = delete;
 
     const std::string   &getResponse() const;
+    ResponseBody        releaseBody();
 
 private:
     std::string    _response;
+    ResponseBody   _body;
 
     ScopedSocket    createProxySocket(addrinfo* proxyInfo);
     void            sendRequestToProxy(ScopedSocket& proxySocket, const std::string& modifiedRequest);
@@ -1,6 +1,6 @@
 #include "StaticFileHandler.hpp"
-#include <filesystem>
 #include <numeric>
+#include <unistd.h>
 #include "ErrorHandler.hpp"
 #include "WebErrors.hpp"
 #include "WebServer.hpp"
@@ -8,18 +8,21 @@
 StaticFileHandler::StaticFileHandler(const Request& request) 
     : _request(request) {}
 
-void StaticFileHandler::serveFile(std::string& response)
+/* Only the headers are built here. Small files come with their body from the response cache,
+   anything else is handed back open in responseBody and sent with sendfile() */
+void StaticFileHandler::serveFile(std::string& response, ResponseBody& responseBody)
 {
     try
     {
         const std::string& fullPath = _request.getRequestData().uri;
-        const bool isAutoIndex = std::filesystem::is_directory(fullPath) && _request.getLocation()->autoIndexOn;
-
-        auto appendHeaders = [&](const std::string& status, const std::string& mimeType, size_t contentLength) {
-            response += "HTTP/1.1 " + status + "\r\n";
-            response += "Content-Type: " + mimeType + "\r\n";
-            response += "Content-Length: " + std::to_string(contentLength) + "\r\n";
-            response += "Cache-Control: max-age=3600\r\n";
+        FileInfo           fileInfo = _request.getFileCache().lookup(fullPath, true);
+        const bool isAutoIndex = fileInfo.isDirectory && _request.getLocation()->autoIndexOn;
+
+        auto appendHeaders = [](std::string& headers, const std::string& status, const std::string& mimeType, size_t contentLength) {
+            headers += "HTTP/1.1 " + status + "\r\n";
+            headers += "Content-Type: " + mimeType + "\r\n";
+            headers += "Content-Length: " + std::to_string(contentLength) + "\r\n";
+            headers += "Cache-Control: max-age=3600\r\n";
         };
 
         if (isAutoIndex)
@@ -27,31 +30,55 @@ void StaticFileHandler::serveFile(std::string& response)
             std::vector<std::string> indexPage = WebParser::generateIndexPage(fullPath);
             std::string content = std::accumulate(indexPage.begin(), indexPage.end(), std::string(""));
 
-            appendHeaders("200 OK", "text/html", content.size());
+            appendHeaders(response, "200 OK", "text/html", content.size());
             response += "\r\n" + content;
             return;
         }
 
-        if (!std::filesystem::exists(fullPath))
+        if (!fileInfo.exists)
         {
             ErrorHandler    errorHandler(_request.getServer());
             errorHandler.handleError(response, NOT_FOUND);
             return;
         }
-
-        std::string fileContent;
-        try {
-            readFileContent(fullPath, fileContent);
-        } catch (const std::exception& e) {
+        if (!fileInfo.file)
+        {
+            WebErrors::printerror("StaticFileHandler::serveFile", "Error opening " + fullPath);
             ErrorHandler    errorHandlerServer(_request.getServer());
             errorHandlerServer.handleError(response, SERVER_ERROR);
             return;
         }
 
-        std::string mimeType = getMimeType(fullPath);
-        appendHeaders("200 OK", mimeType, fileContent.size());
+        ResponseCache &responseCache = _request.getResponseCache();
+        if (responseCache.accepts(fileInfo.size))
+        {
+            std::shared_ptr<const CachedResponse> cached = responseCache.lookup(fullPath, fileInfo.mtime, fileInfo.size);
+            if (!cached)
+            {
+                CachedResponse built;
+
+                built.mtime = fileInfo.mtime;
+                built.size = fileInfo.size;
+                appendHeaders(built.head, "200 OK", getMimeType(fullPath), fileInfo.size);
+                if (!readFile(*fileInfo.file, fileInfo.size, built.body))
+                {
+                    ErrorHandler(_request.getServer()).handleError(response, SERVER_ERROR);
+                    return;
+                }
+                cached = responseCache.insert(fullPath, std::move(built));
+            }
+            response += cached->head;
+            responseBody.data = std::shared_ptr<const std::string>(cached, &cached->body);
+            responseBody.size = cached->body.size();
+        }
+        else
+        {
+            appendHeaders(response, "200 OK", getMimeType(fullPath), fileInfo.size);
+            responseBody.file = std::move(fileInfo.file);
+            responseBody.size = fileInfo.size;
+        }
         handleCookies(_request, response);
-        response += "\r\n" + fileContent;
+        response += "\r\n";
     }
     catch (const std::exception& e)
     {
@@ -128,23 +155,23 @@ std::string StaticFileHandler::getMimeType(const std::string& path) const
     }
 }
 
-void StaticFileHandler::readFileContent(const std::string& path, std::string& content) const
+/* Reads the whole file from the shared fd, pread() leaves its offset alone for everyone else */
+bool StaticFileHandler::readFile(const OpenFile& file, size_t size, std::string& content) const
 {
-    try
+    content.resize(size);
+    size_t done = 0;
+    while (done < size)
     {
-        std::ifstream fileStream(path, std::ios::in | std::ios::binary);
-        if (!fileStream)
+        const ssize_t bytes = pread(file.fd, &content[done], size - done, done);
+
+        if (bytes == -1 && errno == EINTR)
+            continue;
+        if (bytes <= 0)
         {
-            throw std::runtime_error(  "Error: {StaticFileHandler::readFileContent}: " );
+            WebErrors::printerror("StaticFileHandler::readFile", "Error reading file");
+            return false;
         }
-
-        std::ostringstream ss;
-        ss << fileStream.rdbuf();
-        content = ss.str();
-    }
-    catch (const std::exception& e)
-    {
-        WebErrors::printerror("StaticFileHandler::readFileContent", e.what());
-        throw;
+        done += bytes;
     }
+    return true;
 }
@@ -6,7 +6,7 @@ class StaticFileHandler
 {
 public:
     StaticFileHandler(const Request& request);
-    void serveFile(std::string& response);
+    void serveFile(std::string& response, ResponseBody& responseBody);
 
 private:
     const Request& _request;
@@ -14,5 +14,5 @@ private:
     void        handleCookies(const Request &request, std::string &response);
     bool        fileExists(const std::string& path) const;
     std::string getMimeType(const std::string& path) const;
-    void        readFileContent(const std::string& path, std::string& content) const;
+    bool        readFile(const OpenFile& file, size_t size, std::string& content) const;
 };
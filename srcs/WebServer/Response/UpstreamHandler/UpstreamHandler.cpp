@@ -0,0 +1,63 @@
+#include "UpstreamHandler.hpp"
+#include "WebErrors.hpp"
+#include <cstring>
+#include <sys/epoll.h>
+
+/* `upstream` is the host:port (or unix:path) of the backend picked for the request, the pool is keyed by it */
+UpstreamHandler::UpstreamHandler(const Request& req, int clientSocket, UpstreamPool &pool, const addrinfo *upstreamInfo, const std::string &upstream)
+    : _request(req), _clientSocket(clientSocket), _proxyInfo(upstreamInfo), _proxyHost(upstream),
+      _keepAlive(pool.enabled())
+{
+    _socket = pool.acquire(_proxyHost, _requestsServed);
+    _reused = _socket != nullptr;
+    if (_reused)
+        _state = SENDING;
+    else
+        _socket = std::make_unique<ProxySocket>(_proxyInfo, _proxyHost);
+}
+
+/* False while the non-blocking connect is still going on, throws if it failed */
+bool UpstreamHandler::isConnected(uint32_t events)
+{
+    if (_state != CONNECTING)
+        return true;
+    if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+        return false;
+    if (int error = _socket->getConnectError())
+        throw WebErrors::ProxyException("Error connecting to " + _proxyHost + ": " + strerror(error));
+    _state = SENDING;
+    return true;
+}
+
+uint32_t UpstreamHandler::getWantedEvents() const { return _state == RECEIVING ? EPOLLIN : EPOLLOUT; }
+
+int UpstreamHandler::getFd() const { return _socket->getFd(); }
+
+int UpstreamHandler::getClientSocket() const { return _clientSocket; }
+
+bool UpstreamHandler::hasForwarded() const { return _forwarded; }
+
+const std::string &UpstreamHandler::getUpstream() const { return _proxyHost; }
+
+const addrinfo *UpstreamHandler::getAddress() const { return _proxyInfo; }
+
+bool UpstreamHandler::isReusable() const { return _reusable; }
+
+size_t UpstreamHandler::getRequestsServed() const { return _requestsServed; }
+
+std::unique_ptr<ProxySocket> UpstreamHandler::releaseSocket() { return std::move(_socket); }
+
+/* Nothing came back, and either the request never left (the connection could not be made) or it is safe to
+   repeat: it can be sent again on another connection, possibly to another backend */
+bool UpstreamHandler::canRetry() const
+{
+    const std::string &method = _request.getRequestData().method;
+
+    return !_received && (_state == CONNECTING || method == "GET" || method == "HEAD");
+}
+
+/* A pooled connection can be closed by the backend just as it is picked. Failing on one says nothing about
+   the backend itself */
+bool UpstreamHandler::isStale() const { return _reused && !_received; }
+
+bool UpstreamHandler::isConnecting() const { return _state == CONNECTING; }
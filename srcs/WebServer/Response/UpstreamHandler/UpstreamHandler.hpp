@@ -0,0 +1,59 @@
+#pragma once
+
+#include "ProxySocket/ProxySocket.hpp"
+#include "Request.hpp"
+#include "UpstreamPool.hpp"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/* One request answered by a backend over a socket, whatever the protocol: HTTP for proxy_pass (ProxyHandler),
+   FastCGI for fastcgi_pass (FastCGIHandler). The connection is an idle one taken from the pool, or a new one
+   with a non-blocking connect. The event loop drives both the same way, and takes the HTTP response for the
+   client piece by piece with takeResponse() */
+class UpstreamHandler
+{
+public:
+    enum Status { IN_PROGRESS, DONE, FAILED };
+
+    UpstreamHandler(const Request& request, int clientSocket, UpstreamPool &pool, const addrinfo *upstreamInfo, const std::string &upstream);
+    virtual ~UpstreamHandler() = default;
+    UpstreamHandler(const UpstreamHandler &) = delete;
+    UpstreamHandler &operator=(const UpstreamHandler &) = delete;
+
+    virtual Status      handleEvent(uint32_t events, std::vector<char> &readBuffer, bool drain, size_t room) = 0;
+    virtual std::string takeResponse() = 0;
+
+    uint32_t            getWantedEvents() const;
+    int                 getFd() const;
+    int                 getClientSocket() const;
+    bool                hasForwarded() const;
+    const std::string   &getUpstream() const;
+    const addrinfo      *getAddress() const;
+    bool                isReusable() const;
+    bool                canRetry() const;
+    bool                isStale() const;
+    bool                isConnecting() const;
+    size_t              getRequestsServed() const;
+    std::unique_ptr<ProxySocket>    releaseSocket();
+
+protected:
+    enum State { CONNECTING, SENDING, RECEIVING };
+
+    const Request&  _request;
+    int             _clientSocket;
+    const addrinfo  *_proxyInfo;
+    std::string     _proxyHost;
+    std::unique_ptr<ProxySocket>    _socket;
+    size_t          _requestsServed = 0;    // by the connection, before this request
+    bool            _reused = false;
+    bool            _keepAlive = false;
+    State           _state = CONNECTING;
+    std::string     _response;              // ready for the client and not taken yet
+    bool            _received = false;      // the backend has sent something back
+    bool            _forwarded = false;     // some of the response has been taken
+    bool            _reusable = false;
+
+    bool            isConnected(uint32_t events);
+};
@@ -0,0 +1,68 @@
+#include "ResponseCache.hpp"
+
+ResponseCache::ResponseCache(size_t budget, size_t maxEntrySize)
+    : _budget(budget), _maxEntrySize(maxEntrySize)
+{
+}
+
+bool ResponseCache::accepts(size_t fileSize) const
+{
+    return _budget > 0 && fileSize <= _maxEntrySize;
+}
+
+/* Returns nullptr on a miss, an entry for an older version of the file counts as one */
+std::shared_ptr<const CachedResponse> ResponseCache::lookup(const std::string &path, time_t mtime, size_t size)
+{
+    auto it = _entries.find(path);
+
+    if (it != _entries.end() && (it->second.response->mtime != mtime || it->second.response->size != size))
+    {
+        erase(it);
+        it = _entries.end();
+    }
+    if (it == _entries.end())
+    {
+        _stats.misses++;
+        return nullptr;
+    }
+    _stats.hits++;
+    _lru.splice(_lru.begin(), _lru, it->second.lruPosition);
+    return it->second.response;
+}
+
+/* Responses handed out earlier stay valid even after their entry is evicted, they share the buffers */
+std::shared_ptr<const CachedResponse> ResponseCache::insert(const std::string &path, CachedResponse response)
+{
+    auto        cached = std::make_shared<const CachedResponse>(std::move(response));
+    const auto  existing = _entries.find(path);
+
+    if (existing != _entries.end())
+        erase(existing);
+    if (entrySize(*cached) > _budget)
+        return cached;
+    while (_usedBytes + entrySize(*cached) > _budget && !_lru.empty())
+    {
+        erase(_entries.find(_lru.back()));
+        _stats.evictions++;
+    }
+    _lru.push_front(path);
+    _entries.emplace(path, Entry{cached, _lru.begin()});
+    _usedBytes += entrySize(*cached);
+    return cached;
+}
+
+void ResponseCache::erase(std::unordered_map<std::string, Entry>::iterator it)
+{
+    _usedBytes -= entrySize(*it->second.response);
+    _lru.erase(it->second.lruPosition);
+    _entries.erase(it);
+}
+
+size_t ResponseCache::entrySize(const CachedResponse &response)
+{
+    return response.head.size() + response.body.size();
+}
+
+const ResponseCache::Stats &ResponseCache::getStats() const { return _stats; }
+
+size_t ResponseCache::getUsedBytes() const { return _usedBytes; }
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <ctime>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+/* A static file response built once: the status line and headers that never change, and the whole body */
+struct CachedResponse
+{
+    std::string head;       // status line and headers, without the empty line ending them
+    std::string body;
+    time_t      mtime = 0;
+    size_t      size = 0;
+};
+
+/* Fully built responses of small static files, owned by each WebServer. Entries are keyed by resolved path
+   and thrown away as soon as FileCache reports a different mtime or size for the file. The total size
+   of all entries stays under `budget` bytes by dropping the least recently used ones */
+class ResponseCache
+{
+public:
+    struct Stats
+    {
+        size_t hits = 0;
+        size_t misses = 0;
+        size_t evictions = 0;
+    };
+
+    ResponseCache(size_t budget, size_t maxEntrySize);
+    ~ResponseCache() = default;
+    ResponseCache(const ResponseCache &) = delete;
+    ResponseCache &operator=(const ResponseCache &) = delete;
+
+    bool                                    accepts(size_t fileSize) const;
+    std::shared_ptr<const CachedResponse>   lookup(const std::string &path, time_t mtime, size_t size);
+    std::shared_ptr<const CachedResponse>   insert(const std::string &path, CachedResponse response);
+    const Stats                             &getStats() const;
+    size_t                                  getUsedBytes() const;
+
+private:
+    struct Entry
+    {
+        std::shared_ptr<const CachedResponse>   response;
+        std::list<std::string>::iterator        lruPosition;
+    };
+
+    size_t                                  _budget;
+    size_t                                  _maxEntrySize;
+    size_t                                  _usedBytes = 0;
+    Stats                                   _stats;
+    std::unordered_map<std::string, Entry>  _entries;
+    std::list<std::string>                  _lru;           // most recently used at the front
+
+    void                                    erase(std::unordered_map<std::string, Entry>::iterator it);
+    static size_t                           entrySize(const CachedResponse &response);
+};
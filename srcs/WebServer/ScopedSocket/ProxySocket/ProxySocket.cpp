@@ -1,15 +1,22 @@
 #include "ProxySocket.hpp"
+#include <cerrno>
+#include <sys/socket.h>
 
-ProxySocket::ProxySocket(addrinfo* proxyInfo, const std::string& proxyHost)
-    : ScopedSocket(socket(proxyInfo->ai_family, proxyInfo->ai_socktype, proxyInfo->ai_protocol)),
+/* The socket is non-blocking, so the connection is usually still being set up when this returns:
+   the socket becomes writable once it is done, and SO_ERROR tells whether it worked */
+ProxySocket::ProxySocket(const addrinfo* proxyInfo, const std::string& proxyHost)
+    : ScopedSocket(proxyInfo ? socket(proxyInfo->ai_family, proxyInfo->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, proxyInfo->ai_protocol) : -1),
       _proxyHost(proxyHost)
 {
     try
     {
         if (proxyInfo == nullptr)
             throw WebErrors::ProxyException("Invalid proxy info provided");
-        setupSocketOptions();
-        if (this->getFd() < 0 || connect(this->getFd() , proxyInfo->ai_addr, proxyInfo->ai_addrlen) < 0)
+        if (this->getFd() < 0)
+            throw WebErrors::ProxyException("Error creating proxy socket");
+        if (proxyInfo->ai_family != AF_UNIX)
+            setupSocketOptions();
+        if (connect(this->getFd(), proxyInfo->ai_addr, proxyInfo->ai_addrlen) < 0 && errno != EINPROGRESS)
             throw WebErrors::ProxyException("Error connecting to proxy server");
     }
     catch (const WebErrors::ProxyException& e)
@@ -31,6 +38,17 @@ void ProxySocket::setupSocketOptions()
         throw WebErrors::ProxyException("Error setting TCP_NODELAY");
 }
 
+/* 0 once the connection is established, otherwise the errno it failed with */
+int ProxySocket::getConnectError() const
+{
+    int         error = 0;
+    socklen_t   length = sizeof(error);
+
+    if (getsockopt(this->getFd(), SOL_SOCKET, SO_ERROR, &error, &length) < 0)
+        return errno;
+    return error;
+}
+
 const std::string& ProxySocket::getProxyHost() const
 {
     return _proxyHost;
@@ -7,11 +7,12 @@
 class ProxySocket : public ScopedSocket
 {
 public:
-    ProxySocket(addrinfo* proxyInfo, const std::string& proxyHost);
+    ProxySocket(const addrinfo* proxyInfo, const std::string& proxyHost);
     ProxySocket(ProxySocket&& other) noexcept;
     ProxySocket& operator=(ProxySocket&& other) noexcept = delete;
 
     const std::string& getProxyHost() const;
+    int                getConnectError() const;
 
 private:
     std::string _proxyHost;
@@ -2,15 +2,15 @@
 #include "WebErrors.hpp"
 #include "WebParser.hpp"
 
-ServerSocket::ServerSocket(const Server& server, int socket_flags)
-    : ScopedSocket(socket(AF_INET, SOCK_STREAM, 0), socket_flags), _server(server)
+ServerSocket::ServerSocket(const Server& server, int socket_flags, bool reusePort)
+    : ScopedSocket(socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0), socket_flags), _server(server)
 {
     try
     {
         if (this->getFd() < 0) 
             throw WebErrors::ServerException("Error opening server socket for server on port " + std::to_string(server.port));
         
-        setupSocketOptions(1);
+        setupSocketOptions(1, reusePort);
         bindAndListen();
     }
     catch (const std::exception &e)
@@ -26,10 +26,14 @@ ServerSocket::ServerSocket(ServerSocket&& other) noexcept
 
 const Server& ServerSocket::getServer() const { return _server; }
 
-void ServerSocket::setupSocketOptions(int opt)
+// With several workers every worker binds its own listening socket to the same port,
+// and the kernel spreads incoming connections between them
+void ServerSocket::setupSocketOptions(int opt, bool reusePort)
 {
     if (setsockopt(getFd(), SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0)
         throw WebErrors::ServerException("Error setting socket options for server on port " + std::to_string(_server.port));
+    if (reusePort && setsockopt(getFd(), SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)
+        throw WebErrors::ServerException("Error setting SO_REUSEPORT for server on port " + std::to_string(_server.port));
 }
 
 void ServerSocket::bindAndListen()
@@ -7,7 +7,7 @@
 class ServerSocket : public ScopedSocket
 {
 public:
-    ServerSocket(const Server& server, int socket_flags = 0);
+    ServerSocket(const Server& server, int socket_flags = 0, bool reusePort = false);
     ServerSocket(ServerSocket&& other) noexcept;
 
     ServerSocket& operator=(ServerSocket&& other) noexcept = delete;
@@ -15,7 +15,7 @@ public:
     const Server& getServer() const;
 
 private:
-    void setupSocketOptions(int opt);
+    void setupSocketOptions(int opt, bool reusePort);
     void bindAndListen();
 
     const Server&       _server;
@@ -0,0 +1,166 @@
+#include "TimerWheel.hpp"
+#include <algorithm>
+
+TimerWheel::TimerWheel() : _startTime(Clock::now())
+{
+    for (int level = 0; level < WHEEL_LEVELS; ++level)
+        for (int slot = 0; slot < WHEEL_SLOTS; ++slot)
+            _heads[level][slot] = -1;
+}
+
+/* Replaces whatever timer the fd had before */
+void TimerWheel::schedule(int fd, TimerType type, std::chrono::milliseconds delay)
+{
+    if (fd < 0)
+        return;
+    if (static_cast<size_t>(fd) >= _nodes.size())
+        _nodes.resize(std::max(static_cast<size_t>(fd) + 1, _nodes.size() * 2));
+    cancel(fd);
+
+    const uint64_t maxDelta = (1ULL << (WHEEL_SLOT_BITS * WHEEL_LEVELS)) - 1;
+    uint64_t       delta = (delay.count() + WHEEL_RESOLUTION_MS - 1) / WHEEL_RESOLUTION_MS;
+    const uint64_t now = tickOf(Clock::now());
+
+    // The wheel may be lagging behind the clock until the next advance(), count from the real time
+    delta += now - _currentTick;
+    if (delta == 0)
+        delta = 1;
+    if (delta > maxDelta)
+        delta = maxDelta;
+
+    Node &node = _nodes[fd];
+    node.active = true;
+    node.type = type;
+    node.expiryTick = _currentTick + delta;
+    link(fd);
+    _activeCount++;
+}
+
+void TimerWheel::cancel(int fd)
+{
+    if (fd < 0 || static_cast<size_t>(fd) >= _nodes.size() || !_nodes[fd].active)
+        return;
+    unlink(fd);
+    _nodes[fd].active = false;
+    _activeCount--;
+}
+
+bool TimerWheel::isScheduled(int fd, TimerType type) const
+{
+    return fd >= 0 && static_cast<size_t>(fd) < _nodes.size() && _nodes[fd].active && _nodes[fd].type == type;
+}
+
+/* Moves the wheel up to the current time, returning every timer that went off on the way */
+std::vector<TimerWheel::Expired> TimerWheel::advance(Clock::time_point now)
+{
+    std::vector<Expired> expired;
+    const uint64_t       targetTick = tickOf(now);
+
+    if (_activeCount == 0)
+    {
+        _currentTick = std::max(_currentTick, targetTick);
+        return expired;
+    }
+    while (_currentTick < targetTick)
+    {
+        _currentTick++;
+        for (int level = 1; level < WHEEL_LEVELS; ++level)
+        {
+            if ((_currentTick & ((1ULL << (WHEEL_SLOT_BITS * level)) - 1)) != 0)
+                break;
+            cascade(level);
+        }
+
+        const int slot = _currentTick & (WHEEL_SLOTS - 1);
+        while (_heads[0][slot] != -1)
+        {
+            const int fd = _heads[0][slot];
+            expired.emplace_back(fd, _nodes[fd].type);
+            cancel(fd);
+        }
+        if (_activeCount == 0)
+            _currentTick = targetTick;
+    }
+    return expired;
+}
+
+/* Used as the epoll_wait timeout: -1 if nothing is scheduled. If level 0 is empty, the answer is the next
+   point where a higher level cascades down, which may turn out to hold nothing due yet - that only costs a wakeup */
+int TimerWheel::msUntilNextDeadline(Clock::time_point now) const
+{
+    if (_activeCount == 0)
+        return -1;
+
+    const int       currentSlot = _currentTick & (WHEEL_SLOTS - 1);
+    uint64_t        ticksAhead;
+
+    if (_occupied[0] != 0)
+    {
+        // rotate so that bit 0 is the slot right after the current one
+        const int       shift = (currentSlot + 1) & (WHEEL_SLOTS - 1);
+        const uint64_t  rotated = (_occupied[0] >> shift) | (shift ? _occupied[0] << (WHEEL_SLOTS - shift) : 0);
+        ticksAhead = __builtin_ctzll(rotated) + 1;
+    }
+    else
+        ticksAhead = WHEEL_SLOTS - currentSlot;
+
+    const auto deadline = _startTime + std::chrono::milliseconds((_currentTick + ticksAhead) * WHEEL_RESOLUTION_MS);
+    const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count();
+    return remaining > 0 ? static_cast<int>(remaining) : 0;
+}
+
+void TimerWheel::link(int fd)
+{
+    Node           &node = _nodes[fd];
+    const uint64_t  delta = node.expiryTick - _currentTick;
+
+    node.level = 0;
+    while (node.level < WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_SLOT_BITS * (node.level + 1))))
+        node.level++;
+    node.slot = (node.expiryTick >> (WHEEL_SLOT_BITS * node.level)) & (WHEEL_SLOTS - 1);
+
+    int &head = _heads[node.level][node.slot];
+    node.prev = -1;
+    node.next = head;
+    if (head != -1)
+        _nodes[head].prev = fd;
+    head = fd;
+    _occupied[node.level] |= (1ULL << node.slot);
+}
+
+void TimerWheel::unlink(int fd)
+{
+    Node &node = _nodes[fd];
+
+    if (node.prev != -1)
+        _nodes[node.prev].next = node.next;
+    else
+        _heads[node.level][node.slot] = node.next;
+    if (node.next != -1)
+        _nodes[node.next].prev = node.prev;
+    if (_heads[node.level][node.slot] == -1)
+        _occupied[node.level] &= ~(1ULL << node.slot);
+    node.prev = -1;
+    node.next = -1;
+}
+
+/* Redistributes the slot of a higher level that the current tick just reached into the levels below */
+void TimerWheel::cascade(int level)
+{
+    const int slot = (_currentTick >> (WHEEL_SLOT_BITS * level)) & (WHEEL_SLOTS - 1);
+    int       fd = _heads[level][slot];
+
+    _heads[level][slot] = -1;
+    _occupied[level] &= ~(1ULL << slot);
+    while (fd != -1)
+    {
+        const int next = _nodes[fd].next;
+        link(fd);
+        fd = next;
+    }
+}
+
+uint64_t TimerWheel::tickOf(Clock::time_point time) const
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(time - _startTime).count() / WHEEL_RESOLUTION_MS;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#define WHEEL_LEVELS 4
+#define WHEEL_SLOTS 64
+#define WHEEL_SLOT_BITS 6
+#define WHEEL_RESOLUTION_MS 100
+
+enum TimerType { CGI_TIMEOUT, HEADER_TIMEOUT, BODY_TIMEOUT, SEND_TIMEOUT, KEEPALIVE_TIMEOUT, PROXY_TIMEOUT,
+    HEALTH_CHECK_TIMEOUT };
+
+/* Hierarchical timer wheel holding at most one timer per fd (an fd is only ever in one timeout phase).
+   Level 0 has one slot per tick, each higher level covers a whole turn of the level below it,
+   and its slots are cascaded down as time reaches them. Scheduling, cancelling and expiring are O(1) */
+class TimerWheel
+{
+public:
+    using Clock = std::chrono::steady_clock;
+    using Expired = std::pair<int, TimerType>;
+
+    TimerWheel();
+    ~TimerWheel() = default;
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+
+    void                    schedule(int fd, TimerType type, std::chrono::milliseconds delay);
+    void                    cancel(int fd);
+    bool                    isScheduled(int fd, TimerType type) const;
+    std::vector<Expired>    advance(Clock::time_point now);
+    int                     msUntilNextDeadline(Clock::time_point now) const;
+
+private:
+    struct Node
+    {
+        bool        active = false;
+        TimerType   type = HEADER_TIMEOUT;
+        uint64_t    expiryTick = 0;
+        int         level = 0;
+        int         slot = 0;
+        int         prev = -1;
+        int         next = -1;
+    };
+
+    Clock::time_point   _startTime;
+    uint64_t            _currentTick = 0;
+    size_t              _activeCount = 0;
+    std::vector<Node>   _nodes;
+    int                 _heads[WHEEL_LEVELS][WHEEL_SLOTS];
+    uint64_t            _occupied[WHEEL_LEVELS] = {};
+
+    void        link(int fd);
+    void        unlink(int fd);
+    void        cascade(int level);
+    uint64_t    tickOf(Clock::time_point time) const;
+};
@@ -0,0 +1,66 @@
+#include "HealthProbe.hpp"
+#include <cerrno>
+#include <cstdlib>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+HealthProbe::HealthProbe(const addrinfo *info, UpstreamPeer &peer, const std::string &uri)
+    : _peer(peer), _socket(info, peer.address),
+      _request("GET " + uri + " HTTP/1.1\r\nHost: " + peer.address + "\r\nConnection: close\r\n\r\n")
+{
+}
+
+HealthProbe::Status HealthProbe::handleEvent(uint32_t events)
+{
+    if (!_connected)
+    {
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+            return IN_PROGRESS;
+        if (_socket.getConnectError())
+            return UNHEALTHY;
+        _connected = true;
+    }
+    while (_sent < _request.length())
+    {
+        ssize_t bytesSent = send(_socket.getFd(), _request.data() + _sent, _request.length() - _sent, MSG_NOSIGNAL);
+
+        if (bytesSent == -1 && errno == EINTR)
+            continue;
+        if (bytesSent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return IN_PROGRESS;
+        if (bytesSent <= 0)
+            return UNHEALTHY;
+        _sent += bytesSent;
+    }
+    return readStatus();
+}
+
+/* A 2xx or 3xx status is healthy, nothing after the status line matters */
+HealthProbe::Status HealthProbe::readStatus()
+{
+    char buffer[512];
+
+    while (_response.find('\n') == std::string::npos)
+    {
+        ssize_t bytesRead = recv(_socket.getFd(), buffer, sizeof(buffer), 0);
+
+        if (bytesRead == -1 && errno == EINTR)
+            continue;
+        if (bytesRead == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return IN_PROGRESS;
+        if (bytesRead <= 0 || _response.length() > sizeof(buffer))
+            return UNHEALTHY;
+        _response.append(buffer, bytesRead);
+    }
+
+    const size_t    statusPos = _response.find(' ');
+    const int       status = statusPos == std::string::npos ? 0 : std::atoi(_response.c_str() + statusPos + 1);
+
+    return (_response.compare(0, 5, "HTTP/") == 0 && status >= 200 && status < 400) ? HEALTHY : UNHEALTHY;
+}
+
+uint32_t HealthProbe::getWantedEvents() const { return _sent < _request.length() ? EPOLLOUT : EPOLLIN; }
+
+int HealthProbe::getFd() const { return _socket.getFd(); }
+
+UpstreamPeer &HealthProbe::getPeer() { return _peer; }
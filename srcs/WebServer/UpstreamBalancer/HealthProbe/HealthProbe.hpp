@@ -0,0 +1,36 @@
+#pragma once
+
+#include "ProxySocket.hpp"
+#include "UpstreamBalancer.hpp"
+#include <cstdint>
+#include <string>
+
+#define HEALTH_CHECK_TIMEOUT_LIMIT 5 // seconds a server has to answer its health check
+
+/* One health check of an upstream server, driven by epoll events like a proxied request: a non-blocking connect,
+   a GET for the health check uri, then only the status line of the answer is read */
+class HealthProbe
+{
+public:
+    enum Status { IN_PROGRESS, HEALTHY, UNHEALTHY };
+
+    HealthProbe(const addrinfo *info, UpstreamPeer &peer, const std::string &uri);
+    ~HealthProbe() = default;
+    HealthProbe(const HealthProbe &) = delete;
+    HealthProbe &operator=(const HealthProbe &) = delete;
+
+    Status          handleEvent(uint32_t events);
+    uint32_t        getWantedEvents() const;
+    int             getFd() const;
+    UpstreamPeer    &getPeer();
+
+private:
+    UpstreamPeer    &_peer;
+    ProxySocket     _socket;
+    std::string     _request;
+    size_t          _sent = 0;
+    bool            _connected = false;
+    std::string     _response;
+
+    Status          readStatus();
+};
@@ -0,0 +1,239 @@
+#include "UpstreamBalancer.hpp"
+#include "WebServer.hpp"
+#include <algorithm>
+#include <iostream>
+
+/* Every proxy_pass target gets its group: the upstream of that name, or a single server. A target without a port
+   is on the port of the server it is used in */
+UpstreamBalancer::UpstreamBalancer(const std::vector<Upstream> &upstreams, const std::vector<Server> &servers)
+{
+    for (const Upstream &upstream : upstreams)
+    {
+        Group &group = _groups[upstream.name];
+
+        group.balance = upstream.balance;
+        group.healthCheckUri = upstream.health_check_uri;
+        group.healthCheckInterval = std::chrono::seconds(upstream.health_check_interval);
+        for (const UpstreamServer &server : upstream.servers)
+        {
+            UpstreamPeer peer;
+
+            peer.address = server.address;
+            peer.weight = server.weight;
+            peer.maxFails = server.max_fails;
+            peer.failTimeout = std::chrono::seconds(server.fail_timeout);
+            group.peers.push_back(peer);
+        }
+        if (group.balance == URI_HASH)
+        {
+            for (size_t i = 0; i < group.peers.size(); i++)
+            {
+                for (int point = 0; point < group.peers[i].weight * UPSTREAM_HASH_POINTS; point++)
+                    group.ring.emplace_back(hash(group.peers[i].address + "-" + std::to_string(point)), i);
+            }
+            std::sort(group.ring.begin(), group.ring.end());
+        }
+    }
+
+    for (const Server &server : servers)
+    {
+        for (const Location &location : server.locations)
+        {
+            if ((location.type != PROXY && location.type != FASTCGI) || _groups.count(location.target))
+                continue;
+
+            UpstreamPeer peer;
+
+            peer.address = location.target;
+            if (peer.address.rfind(':') == std::string::npos)
+                peer.address += ":" + std::to_string(server.port);
+            _groups[location.target].peers.push_back(peer);
+        }
+    }
+
+    // The only server of a group is never taken out by failures, there would be nothing to send its requests to
+    for (auto &[target, group] : _groups)
+    {
+        if (group.peers.size() == 1)
+            group.peers.front().maxFails = 0;
+    }
+}
+
+/* Returns nullptr when every server of the group is down, or when the target is unknown */
+UpstreamPeer *UpstreamBalancer::choose(const std::string &target, const std::string &uri)
+{
+    auto it = _groups.find(target);
+    if (it == _groups.end())
+        return nullptr;
+
+    Group           &group = it->second;
+    const auto      now = Clock::now();
+    UpstreamPeer    *peer = nullptr;
+
+    if (group.balance == URI_HASH)
+        peer = chooseHash(group, uri, now);
+    else
+        peer = chooseRoundRobin(group, now, group.balance == LEAST_CONN);
+    if (peer)
+        peer->active++;
+    return peer;
+}
+
+/* Called once per chosen peer, when its request is over. A failure is an upstream that could not be reached,
+   broke off or timed out; any answer, even an error status, counts as a success */
+void UpstreamBalancer::release(UpstreamPeer &peer, bool failed, Clock::time_point now)
+{
+    if (peer.active > 0)
+        peer.active--;
+    if (!failed)
+    {
+        peer.fails = 0;
+        return;
+    }
+    if (peer.maxFails == 0)
+        return;
+    if (peer.fails == 0 || now - peer.firstFail > peer.failTimeout)
+    {
+        peer.fails = 0;
+        peer.firstFail = now;
+    }
+    if (++peer.fails >= peer.maxFails)
+    {
+        peer.downUntil = now + peer.failTimeout;
+        peer.fails = 0;
+        std::cout << COLOR_RED_ERROR << "  Upstream server " << peer.address << " is down for "
+            << peer.failTimeout.count() << "s ⛔\n\n" << COLOR_RESET;
+    }
+}
+
+/* Every host:port a connection can be made to, for them to be resolved */
+std::vector<std::string> UpstreamBalancer::addresses() const
+{
+    std::vector<std::string> addresses;
+
+    for (const auto &[target, group] : _groups)
+    {
+        for (const UpstreamPeer &peer : group.peers)
+        {
+            if (std::find(addresses.begin(), addresses.end(), peer.address) == addresses.end())
+                addresses.push_back(peer.address);
+        }
+    }
+    return addresses;
+}
+
+/* The host:port of each server of the proxy_pass target */
+std::vector<std::string> UpstreamBalancer::addresses(const std::string &target) const
+{
+    std::vector<std::string> addresses;
+
+    auto it = _groups.find(target);
+    if (it == _groups.end())
+        return addresses;
+    for (const UpstreamPeer &peer : it->second.peers)
+        addresses.push_back(peer.address);
+    return addresses;
+}
+
+/* The servers of the groups whose health check interval has passed, except those whose last check is still running */
+std::vector<UpstreamBalancer::HealthCheck> UpstreamBalancer::dueHealthChecks(Clock::time_point now)
+{
+    std::vector<HealthCheck> checks;
+
+    for (auto &[target, group] : _groups)
+    {
+        if (group.healthCheckUri.empty() || now < group.nextHealthCheck)
+            continue;
+        group.nextHealthCheck = now + group.healthCheckInterval;
+        for (UpstreamPeer &peer : group.peers)
+        {
+            if (peer.probing)
+                continue;
+            peer.probing = true;
+            checks.push_back({&peer, group.healthCheckUri});
+        }
+    }
+    return checks;
+}
+
+void UpstreamBalancer::reportHealthCheck(UpstreamPeer &peer, bool healthy)
+{
+    peer.probing = false;
+    if (healthy == peer.healthy)
+        return;
+    peer.healthy = healthy;
+    if (healthy)
+        std::cout << COLOR_GREEN_SERVER << "  Upstream server " << peer.address << " passed its health check ✅\n\n" << COLOR_RESET;
+    else
+        std::cout << COLOR_RED_ERROR << "  Upstream server " << peer.address << " failed its health check ⛔\n\n" << COLOR_RESET;
+}
+
+bool UpstreamBalancer::isAvailable(const UpstreamPeer &peer, Clock::time_point now)
+{
+    return peer.healthy && now >= peer.downUntil;
+}
+
+/* Smooth weighted round-robin: every available server gains its weight, the one that has gained the most is
+   picked and gives back the total, so servers a, b, c of weights 3, 1, 1 get a, b, a, c, a, ...
+   With leastConnected, only the servers with the fewest requests in progress per weight take part */
+UpstreamPeer *UpstreamBalancer::chooseRoundRobin(Group &group, Clock::time_point now, bool leastConnected)
+{
+    UpstreamPeer    *least = nullptr;
+    UpstreamPeer    *best = nullptr;
+    int             totalWeight = 0;
+
+    if (leastConnected)
+    {
+        for (UpstreamPeer &peer : group.peers)
+        {
+            if (isAvailable(peer, now) && (!least || peer.active * least->weight < least->active * peer.weight))
+                least = &peer;
+        }
+    }
+    for (UpstreamPeer &peer : group.peers)
+    {
+        if (!isAvailable(peer, now)
+            || (least && peer.active * least->weight != least->active * peer.weight))
+            continue;
+        peer.currentWeight += peer.weight;
+        totalWeight += peer.weight;
+        if (!best || peer.currentWeight > best->currentWeight)
+            best = &peer;
+    }
+    if (best)
+        best->currentWeight -= totalWeight;
+    return best;
+}
+
+/* The URI lands on the first point of the ring at or after its hash. When that server is down the next points
+   are tried, so only the URIs of the missing server move */
+UpstreamPeer *UpstreamBalancer::chooseHash(Group &group, const std::string &uri, Clock::time_point now)
+{
+    if (group.ring.empty())
+        return nullptr;
+
+    const std::pair<uint32_t, size_t>   key(hash(uri), 0);
+    size_t                              index = std::lower_bound(group.ring.begin(), group.ring.end(), key) - group.ring.begin();
+
+    for (size_t tried = 0; tried < group.ring.size(); tried++, index++)
+    {
+        UpstreamPeer &peer = group.peers[group.ring[index % group.ring.size()].second];
+
+        if (isAvailable(peer, now))
+            return &peer;
+    }
+    return nullptr;
+}
+
+/* FNV-1a, the same key gives the same server in every worker and after a restart */
+uint32_t UpstreamBalancer::hash(const std::string &key)
+{
+    uint32_t hash = 2166136261u;
+
+    for (unsigned char c : key)
+    {
+        hash ^= c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "WebParser.hpp"
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#define UPSTREAM_HASH_POINTS 160 // points per unit of weight a server gets on the consistent hash ring
+
+/* One server of an upstream group, as this worker sees it */
+struct UpstreamPeer
+{
+    std::string                             address;            // host:port, also what the keep-alive pool is keyed by
+    int                                     weight = 1;
+    int                                     maxFails = 1;
+    std::chrono::seconds                    failTimeout{10};
+
+    int                                     currentWeight = 0;  // smooth weighted round-robin
+    size_t                                  active = 0;         // requests in progress
+    int                                     fails = 0;
+    std::chrono::steady_clock::time_point   firstFail;          // start of the window the fails are counted in
+    std::chrono::steady_clock::time_point   downUntil;
+    bool                                    healthy = true;     // result of the last health check
+    bool                                    probing = false;
+};
+
+/* Picks the server of a proxy_pass target for each request, per worker. A plain host:port target is a group of
+   one server. A server is skipped while max_fails failures within fail_timeout keep it down (unless it is the
+   only one of its group), or while its last health check failed */
+class UpstreamBalancer
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct HealthCheck
+    {
+        UpstreamPeer    *peer;
+        std::string     uri;
+    };
+
+    UpstreamBalancer(const std::vector<Upstream> &upstreams, const std::vector<Server> &servers);
+    ~UpstreamBalancer() = default;
+    UpstreamBalancer(const UpstreamBalancer &) = delete;
+    UpstreamBalancer &operator=(const UpstreamBalancer &) = delete;
+
+    UpstreamPeer                *choose(const std::string &target, const std::string &uri);
+    void                        release(UpstreamPeer &peer, bool failed, Clock::time_point now);
+    std::vector<std::string>    addresses() const;
+    std::vector<std::string>    addresses(const std::string &target) const;
+    std::vector<HealthCheck>    dueHealthChecks(Clock::time_point now);
+    void                        reportHealthCheck(UpstreamPeer &peer, bool healthy);
+
+private:
+    struct Group
+    {
+        BalanceMethod                           balance = ROUND_ROBIN;
+        std::vector<UpstreamPeer>               peers;
+        std::vector<std::pair<uint32_t, size_t>> ring;  // URI_HASH: hash points and the peer they belong to
+        std::string                             healthCheckUri;
+        std::chrono::seconds                    healthCheckInterval{10};
+        Clock::time_point                       nextHealthCheck;
+    };
+
+    std::unordered_map<std::string, Group>  _groups;    // by proxy_pass target, never resized after construction
+
+    static bool         isAvailable(const UpstreamPeer &peer, Clock::time_point now);
+    static UpstreamPeer *chooseRoundRobin(Group &group, Clock::time_point now, bool leastConnected);
+    static UpstreamPeer *chooseHash(Group &group, const std::string &uri, Clock::time_point now);
+    static uint32_t     hash(const std::string &key);
+};
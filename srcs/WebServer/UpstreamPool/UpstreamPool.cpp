@@ -0,0 +1,70 @@
+#include "UpstreamPool.hpp"
+#include <cerrno>
+#include <sys/socket.h>
+
+UpstreamPool::UpstreamPool(size_t maxIdle, int idleTimeout, size_t maxRequests)
+    : _maxIdle(maxIdle), _idleTimeout(idleTimeout), _maxRequests(maxRequests)
+{
+}
+
+/* The most recently used connection is tried first, it is the least likely to have been closed by the upstream.
+   Returns nullptr when there is nothing usable, the caller then opens a new connection */
+std::unique_ptr<ProxySocket> UpstreamPool::acquire(const std::string &upstream, size_t &requestsServed)
+{
+    auto it = _idle.find(upstream);
+    if (it == _idle.end())
+        return nullptr;
+
+    const auto  now = std::chrono::steady_clock::now();
+    auto        &connections = it->second;
+
+    while (!connections.empty())
+    {
+        IdleConnection connection = std::move(connections.back());
+
+        connections.pop_back();
+        if (now - connection.idleSince < _idleTimeout && isAlive(*connection.socket))
+        {
+            requestsServed = connection.requestsServed;
+            return std::move(connection.socket);
+        }
+    }
+    return nullptr;
+}
+
+void UpstreamPool::release(const std::string &upstream, std::unique_ptr<ProxySocket> socket, size_t requestsServed)
+{
+    if (!enabled() || requestsServed >= _maxRequests)
+        return;
+
+    auto &connections = _idle[upstream];
+
+    connections.push_back({std::move(socket), requestsServed, std::chrono::steady_clock::now()});
+    if (connections.size() > _maxIdle)
+        connections.pop_front();
+}
+
+/* Closes the connections that have been idle for too long, so they don't hold on to fds */
+void UpstreamPool::prune(std::chrono::steady_clock::time_point now)
+{
+    for (auto &[upstream, connections] : _idle)
+    {
+        while (!connections.empty() && now - connections.front().idleSince >= _idleTimeout)
+            connections.pop_front();
+    }
+}
+
+/* The upstream moved to other addresses, its idle connections still go to the old ones */
+void UpstreamPool::discard(const std::string &upstream) { _idle.erase(upstream); }
+
+bool UpstreamPool::enabled(void) const { return _maxIdle > 0; }
+
+/* An idle connection has nothing to read: end of file means the upstream closed it, and data it sent
+   on its own (some servers send a 408 before closing) means it can't be trusted with another request */
+bool UpstreamPool::isAlive(const ProxySocket &socket)
+{
+    char    byte;
+    ssize_t bytesRead = recv(socket.getFd(), &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    return bytesRead == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
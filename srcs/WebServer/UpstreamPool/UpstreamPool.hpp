@@ -0,0 +1,42 @@
+#pragma once
+
+#include "ProxySocket.hpp"
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+/* Idle keep-alive connections to proxy_pass upstreams, per upstream (the proxy_pass target) and owned by each
+   WebServer. A connection goes back in after a response that left it reusable and is handed out again to the
+   next request for the same upstream, so that request skips the TCP handshake. At most `maxIdle` connections
+   are kept per upstream, each for at most `idleTimeout` seconds and `maxRequests` requests */
+class UpstreamPool
+{
+public:
+    UpstreamPool(size_t maxIdle, int idleTimeout, size_t maxRequests);
+    ~UpstreamPool() = default;
+    UpstreamPool(const UpstreamPool &) = delete;
+    UpstreamPool &operator=(const UpstreamPool &) = delete;
+
+    std::unique_ptr<ProxySocket>    acquire(const std::string &upstream, size_t &requestsServed);
+    void                            release(const std::string &upstream, std::unique_ptr<ProxySocket> socket, size_t requestsServed);
+    void                            prune(std::chrono::steady_clock::time_point now);
+    void                            discard(const std::string &upstream);
+    bool                            enabled(void) const;
+
+private:
+    struct IdleConnection
+    {
+        std::unique_ptr<ProxySocket>            socket;
+        size_t                                  requestsServed;
+        std::chrono::steady_clock::time_point   idleSince;
+    };
+
+    size_t                                                          _maxIdle;
+    std::chrono::seconds                                            _idleTimeout;
+    size_t                                                          _maxRequests;
+    std::unordered_map<std::string, std::deque<IdleConnection>>     _idle;  // oldest at the front
+
+    static bool                     isAlive(const ProxySocket &socket);
+};
@@ -9,29 +9,52 @@
 #include <fcntl.h>
 #include <iostream>
 #include <cstring>
+#include <strings.h>
+#include <system_error>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #include "Response.hpp"
 #include "Request.hpp"
 
 volatile sig_atomic_t WebServer::s_serverRunning = 1;
 
-WebServer::WebServer(WebParser &parser)
-    : _epollFd(-1), _parser(parser), _events(MAX_EVENTS)
+WebServer::WebServer(WebParser &parser, int workerId)
+    : _epollFd(-1), _workerId(workerId), _parser(parser), _events(MAX_EVENTS),
+      _readBuffer(parser.getReadBufferSize()), _edgeTriggered(parser.getEdgeTriggered()),
+      _fileCache(parser.getOpenFileCacheSize(), parser.getOpenFileCacheValid()),
+      _responseCache(parser.getResponseCacheSize(), parser.getResponseCacheMaxFileSize()),
+      _upstreamPool(parser.getProxyKeepaliveConnections(), parser.getProxyKeepaliveTimeout(), parser.getProxyKeepaliveRequests()),
+      _balancer(parser.getUpstreams(), parser.getServers()),
+      _resolver(_balancer.addresses(), parser.getProxyResolveInterval())
 {
     try
     {
-        std::cout << COLOR_GREEN_SERVER << "[ SERVER STARTED ] press Ctrl+C to stop 🏭 \n\n" << COLOR_RESET;
+        if (_parser.getWorkerThreads() > 1)
+            std::cout << COLOR_GREEN_SERVER << "[ WORKER " << _workerId << " STARTED ] 🏭 \n\n" << COLOR_RESET;
+        else
+            std::cout << COLOR_GREEN_SERVER << "[ SERVER STARTED ] press Ctrl+C to stop 🏭 \n\n" << COLOR_RESET;
         _serverSockets = createServerSockets(parser.getServers());
-        resolveProxyAddresses(parser.getServers());
-        _epollFd = epoll_create(1);
+        _epollFd = epoll_create1(EPOLL_CLOEXEC);
         if (_epollFd == -1)
             throw WebErrors::ServerException("Error creating epoll");
         for (const auto& serverSocket : _serverSockets)
+        {
+            addConnection(serverSocket.getFd(), FdType::SERVER).server = &serverSocket.getServer();
             epollController(serverSocket.getFd(), EPOLL_CTL_ADD, EPOLLIN, FdType::SERVER);
+        }
+        for (const Server &server : parser.getServers())
+        {
+            for (const Location &location : server.locations)
+            {
+                if (location.cgi_pool > 0 && !_cgiPools.count(location.target))
+                    _cgiPools.emplace(location.target, std::make_unique<CGIPool>(location));
+            }
+        }
     }
     catch (const std::exception& e)
     {
@@ -41,14 +64,6 @@ WebServer::WebServer(WebParser &parser)
 
 WebServer::~WebServer()
 {
-    for (auto& entry : _proxyInfoMap)
-    {
-        if (entry.second)
-        {
-            freeaddrinfo(entry.second);
-            entry.second = nullptr;
-        }
-    }
     if (_epollFd != -1)
     {
         close(_epollFd);
@@ -56,56 +71,6 @@ WebServer::~WebServer()
     }
 }
 
-void WebServer::resolveProxyAddresses(const std::vector<Server>& server_confs)
-{
-    try
-    {
-        for (const auto& server : server_confs)
-        {
-            for (const auto& location : server.locations)
-            {
-                if (location.type == PROXY)
-                {
-                    std::string proxyHost;
-                    std::string proxyPort;
-
-                    size_t colonPos = location.target.rfind(':');
-                    if (colonPos != std::string::npos)
-                    {
-                        proxyHost = location.target.substr(0, colonPos);
-                        proxyPort = location.target.substr(colonPos + 1);
-                    }
-                    else
-                    {
-                        proxyHost = location.target;
-                        proxyPort = std::to_string(server.port);
-                    }
-
-                    std::string key = proxyHost + ":" + proxyPort;
-                    if (_proxyInfoMap.find(key) == _proxyInfoMap.end())
-                    {
-                        addrinfo hints{};
-                        hints.ai_family = AF_UNSPEC;
-                        hints.ai_socktype = SOCK_STREAM;
-
-                        addrinfo* proxyInfo = nullptr;
-                        int status = getaddrinfo(proxyHost.c_str(), proxyPort.c_str(), &hints, &proxyInfo);
-                        if (status != 0)
-                        {
-                            throw WebErrors::ProxyException( "Error resolving proxy address" );
-                        }
-                        _proxyInfoMap[key] = proxyInfo;
-                    }
-                }
-            }
-        }
-    }
-    catch (const std::exception& e)
-    {
-        throw;
-    }
-}
-
 std::vector<ServerSocket> WebServer::createServerSockets(const std::vector<Server> &server_confs)
 {
     try
@@ -114,7 +79,7 @@ std::vector<ServerSocket> WebServer::createServerSockets(const std::vector<Serve
 
         for (const auto& server_conf : server_confs) 
         {
-            ServerSocket serverSocket(server_conf, O_NONBLOCK | FD_CLOEXEC);
+            ServerSocket serverSocket(server_conf, O_NONBLOCK, _parser.getWorkerThreads() > 1);
             serverSockets.push_back(std::move(serverSocket));
         }
         return serverSockets;
@@ -125,6 +90,7 @@ std::vector<ServerSocket> WebServer::createServerSockets(const std::vector<Serve
     }
 }
 
+/* The fd type rides along in the upper half of epoll_event.data, the fd itself in the lower half */
 void WebServer::epollController(int clientSocket, int operation, uint32_t events, FdType fdType)
 {
     try
@@ -132,10 +98,12 @@ void WebServer::epollController(int clientSocket, int operation, uint32_t events
         struct epoll_event event;
 
         std::memset(&event, 0, sizeof(event));
-        event.data.fd = clientSocket;
+        event.data.u64 = (static_cast<uint64_t>(fdType) << 32) | static_cast<uint32_t>(clientSocket);
         event.events = events;
+        if (_edgeTriggered && operation != EPOLL_CTL_DEL)
+            event.events |= EPOLLET;
 
-        if (EPOLL_CTL_ADD)
+        if (operation == EPOLL_CTL_ADD)
         {
             switch (fdType)
             {
@@ -148,15 +116,28 @@ void WebServer::epollController(int clientSocket, int operation, uint32_t events
                 case FdType::CGI_PIPE:
                     std::cout << COLOR_GREEN_SERVER << " { CGI pipe added to epoll 🏊 }\n\n" << COLOR_RESET;
                     break;
+                case FdType::UPSTREAM:
+                    std::cout << COLOR_GREEN_SERVER << " { Upstream socket added to epoll 🏊 }\n\n" << COLOR_RESET;
+                    break;
+                case FdType::CGI_INPUT:
+                    std::cout << COLOR_GREEN_SERVER << " { CGI input pipe added to epoll 🏊 }\n\n" << COLOR_RESET;
+                    break;
+                case FdType::HEALTH_CHECK: // every few seconds per server, not worth a line
+                case FdType::CGI_PROCESS:
+                    break;
             }
         }
         if (epoll_ctl(_epollFd, operation, clientSocket, &event) == -1)
         {
+            removeConnection(clientSocket);
             close(clientSocket);
             throw std::runtime_error("Error changing epoll state: " + std::string(strerror(errno)));
         }
+        if (operation == EPOLL_CTL_ADD && !getConnection(clientSocket, fdType))
+            addConnection(clientSocket, fdType);
         if (operation == EPOLL_CTL_DEL)
         {
+            removeConnection(clientSocket);
             close(clientSocket);
             clientSocket = -1;
         }
@@ -167,19 +148,56 @@ void WebServer::epollController(int clientSocket, int operation, uint32_t events
     }
 }
 
+/* Returns nullptr if nothing of that type is open on the fd (e.g. an event for an fd closed earlier in the same batch) */
+Connection *WebServer::getConnection(int fd, FdType fdType) const
+{
+    if (fd < 0 || static_cast<size_t>(fd) >= _connections.size() || !_connections[fd] || _connections[fd]->type != fdType)
+        return nullptr;
+    return _connections[fd].get();
+}
+
+Connection &WebServer::addConnection(int fd, FdType fdType)
+{
+    if (static_cast<size_t>(fd) >= _connections.size())
+        _connections.resize(std::max(static_cast<size_t>(fd) + 1, _connections.size() * 2));
+    _connections[fd] = std::make_unique<Connection>();
+    _connections[fd]->type = fdType;
+    _connections[fd]->fd = fd;
+    return *_connections[fd];
+}
+
+void WebServer::removeConnection(int fd)
+{
+    if (fd >= 0 && static_cast<size_t>(fd) < _connections.size())
+        _connections[fd].reset();
+    _timers.cancel(fd);
+}
+
+/* In edge-triggered mode the whole accept backlog has to be emptied, there won't be another event for it */
 void WebServer::acceptAddClientToEpoll(int clientSocketFd)
 {
     try
     {
-        struct sockaddr_in  clientAddr;
-        socklen_t           clientLen = sizeof(clientAddr);
-        ScopedSocket        clientSocket(accept(clientSocketFd, (struct sockaddr *)&clientAddr, &clientLen), 0);
+        const Server *server = getConnection(clientSocketFd, FdType::SERVER)->server;
+        do
+        {
+            struct sockaddr_in  clientAddr;
+            socklen_t           clientLen = sizeof(clientAddr);
+            const int           clientSocket = accept4(clientSocketFd, (struct sockaddr *)&clientAddr, &clientLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
 
-        if (clientSocket.getFd() < 0)
-            throw std::runtime_error( "Error accepting client" );
-        setFdNonBlocking(clientSocketFd);
-        epollController(clientSocket.getFd(), EPOLL_CTL_ADD, EPOLLIN, FdType::CLIENT);
-        clientSocket.release();
+            if (clientSocket < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return;
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                throw std::runtime_error( "Error accepting client" );
+            }
+            Connection &client = addConnection(clientSocket, FdType::CLIENT);
+            client.server = server;
+            watchConnection(client, EPOLLIN);
+            _timers.schedule(clientSocket, HEADER_TIMEOUT, std::chrono::seconds(server->client_header_timeout));
+        } while (_edgeTriggered);
     }
     catch (const std::exception &e)
     {
@@ -189,319 +207,1171 @@ void WebServer::acceptAddClientToEpoll(int clientSocketFd)
 
 void WebServer::handleIncomingData(int clientSocket)
 {
-    bool stopProcessing = false;
+    Connection  &client = *getConnection(clientSocket, FdType::CLIENT);
+    bool        peerClosed = false;
 
-    auto cleanupClient = [this](int clientSocket)
+    auto drainSocket = [this, &client, &peerClosed]() -> ssize_t
     {
-        epollController(clientSocket, EPOLL_CTL_DEL, 0, FdType::CLIENT);
-        _partialRequests.erase(clientSocket);
-        _requestMap.erase(clientSocket);
-    };
+        ssize_t totalRead = 0;
 
-    auto isRequestComplete = [this, clientSocket, &stopProcessing](const std::string &request) -> bool
-    {
-        auto checkMaxBodySize = [&, this](const size_t &content_length, const std::string &request, int clientSocket) -> bool
+        while (true)
         {
-            auto hostIt = request.find("Host: ");
-            if (hostIt == std::string::npos) return false;
+            ssize_t bytesRead = recv(client.fd, _readBuffer.data(), _readBuffer.size(), 0);
 
-            std::string host = request.substr(hostIt + 6, request.find("\r\n", hostIt) - hostIt - 6);
-
-            for (const auto &server : _parser.getServers())
+            if (bytesRead > 0)
             {
-                for (const auto &server_name : server.server_name)
+                client.partialRequest.append(_readBuffer.data(), bytesRead);
+                parseRequests(client); // moves body bytes out right away, so a drain never piles up an upload
+                totalRead += bytesRead;
+                if (!_edgeTriggered)
+                    return totalRead;
+                // the rest would only pile up behind a full queue, it is read once serveRequests has made room
+                if (client.requests.size() >= MAX_PIPELINED_REQUESTS)
                 {
-                    const std::string server_name_ports = server_name + ":" + std::to_string(server.port);
-                    if (server_name_ports == host && static_cast<long>(content_length) > server.client_max_body_size)
-                    {
-                        std::cout << COLOR_RED_ERROR << "  Request body size exceeds client_max_body_size limit\n\n" << COLOR_RESET;
-                        ErrorHandler(&server).handleError(_partialRequests[clientSocket], 413);
-                        const int ret = send (clientSocket, _partialRequests[clientSocket].c_str(), _partialRequests[clientSocket].length(), 0);
-                        if (ret == -1)
-                            std::cerr << COLOR_RED_ERROR << "Error sending 413 response to client: " << strerror(errno) << "\n\n" << COLOR_RESET;
-                        else if (ret == 0)
-                            std::cerr << COLOR_RED_ERROR << "Error sending 413 response to client, Connection closed by the client: " << strerror(errno) << "\n\n" << COLOR_RESET;
-                        stopProcessing = true;
-                        return true;
-                    }
+                    client.readPending = true;
+                    return totalRead;
                 }
             }
-            return false;
-        };
+            else if (bytesRead == 0)
+            {
+                peerClosed = true;
+                return totalRead;
+            }
+            else if (errno == EINTR)
+                continue;
+            else if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return totalRead;
+            else
+                return -1;
+        }
+    };
+
+    try
+    {
+        client.readPending = false;
+        ssize_t bytesRead = drainSocket();
 
-        size_t              headerEnd = request.find("\r\n\r\n");
+        if (peerClosed)
+        {
+            cleanupClient(clientSocket);
+        }
+        else if (bytesRead == -1)
+        {
+            cleanupClient(clientSocket);
+            WebErrors::printerror("WebServer::handleIncomingData", "Error receiving data from client");
+        }
+        else // nothing read is possible when resuming a drain that had stopped right at the end of the data
+            serveRequests(client);
+    }
+    catch (const std::exception &e)
+    {
+        cleanupClient(clientSocket);
+        throw ;
+    }
+}
 
-        if (headerEnd == std::string::npos)
-            return false;
+/* The server whose client_max_body_size applies to the request being parsed: the one its Host header names,
+   or the one the connection was accepted on */
+const Server *WebServer::findBodyLimitServer(const Connection &client) const
+{
+    const std::string *host = client.parser.getHeader("Host");
+    if (!host) return client.server;
 
-        size_t              contentLength = 0;
-        std::istringstream  stream(request.substr(0, headerEnd + 4));
-        std::string         line;
+    for (const auto &server : _parser.getServers())
+    {
+        for (const auto &server_name : server.server_name)
+        {
+            if (server_name + ":" + std::to_string(server.port) == *host)
+                return &server;
+        }
+    }
+    return client.server;
+}
 
-        while (std::getline(stream, line) && line != "\r")
+/* Moves every complete request in the receive buffer to the connection's queue (pipelining). A request that
+   can't be accepted ends the parsing, it is answered with an error once everything before it has been answered */
+void WebServer::parseRequests(Connection &client)
+{
+    try
+    {
+        while (client.rejectCode == 0 && client.requests.size() < MAX_PIPELINED_REQUESTS)
         {
-            if (line.find("Content-Length:") != std::string::npos)
+            bool complete = client.parser.parse(client.partialRequest);
+
+            if (client.parser.getState() == RequestParser::HEADERS_DONE)
             {
-                contentLength = std::stoul(line.substr(15));
-                if (checkMaxBodySize(contentLength, request, clientSocket))
-                    return true;
-                break;
+                const Server *server = findBodyLimitServer(client);
+
+                client.rejectServer = server;
+                if (static_cast<long>(client.parser.getContentLength()) > server->client_max_body_size)
+                    throw WebErrors::BodyTooLargeException("Request body size exceeds client_max_body_size limit");
+                client.parser.acceptBody(_parser.getClientBodyBufferSize(), server->client_max_body_size);
+                complete = client.parser.parse(client.partialRequest);
             }
-        }
+            if (!complete)
+                break;
 
-        const size_t totalLength = headerEnd + 4 + contentLength;
-        return request.length() >= totalLength;
-    };
+            client.requests.emplace_back(client.parser.takeRequest(), _parser.getServers(),
+                _fileCache, _responseCache);
 
-    auto extractCompleteRequest = [](const std::string &buffer) -> std::string
+            const Request &request = client.requests.back();
+            std::cout << COLOR_MAGENTA_SERVER << "  Request to: " << request.getServer()->server_name[0]
+                      << ":" << request.getServer()->port << request.getRequestData().originalUri << " ✉️\n\n"
+                      << COLOR_RESET;
+        }
+    }
+    catch (const WebErrors::BodyTooLargeException &e)
     {
-        size_t              headerEnd = buffer.find("\r\n\r\n");
+        std::cout << COLOR_RED_ERROR << "  " << e.what() << "\n\n" << COLOR_RESET;
+        client.rejectCode = REQUEST_BODY_TOO_LARGE;
+    }
+    catch (const std::system_error &e) // the body could not be stored, not the client's fault
+    {
+        WebErrors::printerror("WebServer::parseRequests", e.what());
+        client.rejectCode = SERVER_ERROR;
+        client.rejectServer = client.server;
+    }
+    catch (const std::exception &e)
+    {
+        WebErrors::printerror("WebServer::parseRequests", e.what());
+        client.rejectCode = BAD_REQUEST;
+        client.rejectServer = client.server;
+    }
+    if (client.rejectCode != 0)
+    {
+        client.partialRequest.clear();
+        client.parser.reset();
+    }
+}
 
-        if (headerEnd == std::string::npos)
-            return "";
-        size_t              contentLength = 0;
-        std::istringstream  stream(buffer.substr(0, headerEnd + 4));
-        std::string         line;
+/* Answers the queued requests strictly in the order they arrived. Consecutive static responses are queued
+   together and leave in one gathered write, a CGI or proxied request waits until everything before it has
+   been sent. Afterwards the socket is watched for whatever comes next: writing, reading, or nothing while a
+   script or an upstream is working on the answer */
+void WebServer::serveRequests(Connection &client)
+{
+    while (!client.closing && !client.backendRunning && !client.requests.empty())
+    {
+        Request &request = client.requests.front();
 
-        while (std::getline(stream, line) && line != "\r")
+        if (request.getLocation()->type == LocationType::CGI && request.getErrorCode() == 0)
         {
-            if (line.find("Content-Length:") != std::string::npos)
-            {
-                contentLength = std::stoul(line.substr(15));
+            if (!client.output.empty() || startCgi(client))
                 break;
-            }
+            continue;
         }
-        const size_t        totalLength = headerEnd + 4 + contentLength;
-        return buffer.substr(0, totalLength);
-    };
+        if ((request.getLocation()->type == LocationType::PROXY || request.getLocation()->type == LocationType::FASTCGI)
+            && request.getErrorCode() == 0)
+        {
+            if (!client.output.empty() || startProxy(client))
+                break;
+            continue;
+        }
+
+        Response     res(request);
+        std::string  response = res.getResponse();
+        const bool   keepAlive = shouldKeepAlive(client, request, response);
 
-    auto processRequest = [this](int clientSocket, const std::string &requestStr)
+        client.requests.pop_front();
+        queueResponse(client, std::move(response), keepAlive, res.releaseBody());
+    }
+    if (!client.closing && !client.backendRunning && client.requests.empty() && client.rejectCode != 0)
     {
-        Request request(requestStr, _parser.getServers(), _proxyInfoMap);
-        _requestMap[clientSocket] = request;
+        std::string response;
+        ErrorHandler(client.rejectServer).handleError(response, client.rejectCode);
+        queueResponse(client, std::move(response), false);
+    }
 
-        std::cout << COLOR_MAGENTA_SERVER << "  Request to: " << request.getServer()->server_name[0]
-                  << ":" << request.getServer()->port << request.getRequestData().originalUri << " ✉️\n\n"
-                  << COLOR_RESET;
+    if (client.backendRunning && !client.output.empty())
+        return watchConnection(client, EPOLLOUT);
+    if (client.backendRunning) // a streamed response has been sent up to what the upstream gave so far
+    {
+        _timers.cancel(client.fd);
+        return watchConnection(client, 0);
+    }
+    if (!client.output.empty())
+        return watchConnection(client, EPOLLOUT);
 
-        if (request.getLocation()->type == LocationType::CGI && request.getErrorCode() == 0)
+    if (client.readPending) // no new edge comes for what was left in the socket
+        return handleIncomingData(client.fd);
+    watchConnection(client, EPOLLIN);
+    if (client.partialRequest.empty())
+        _timers.schedule(client.fd, KEEPALIVE_TIMEOUT, std::chrono::seconds(client.server->keepalive_timeout));
+    else if (client.parser.headersComplete())
+        _timers.schedule(client.fd, BODY_TIMEOUT, std::chrono::seconds(client.server->client_body_timeout));
+    else if (!_timers.isScheduled(client.fd, HEADER_TIMEOUT))
+        _timers.schedule(client.fd, HEADER_TIMEOUT, std::chrono::seconds(client.server->client_header_timeout));
+}
+
+/* Runs the CGI request at the front of the queue. Returns false if the script could not be started,
+   in which case its error response has been queued instead */
+bool WebServer::startCgi(Connection &client)
+{
+    auto pool = _cgiPools.find(client.requests.front().getLocation()->target);
+
+    if (pool != _cgiPools.end() && pool->second->accepts(client.requests.front()))
+        return startPooledCgi(client, *pool->second);
+
+    _currentEventFd = client.fd;
+    CGIHandler  cgiHandler(client.requests.front(), *this);
+    std::string failure = cgiHandler.getCGIResponse();
+
+    if (!failure.empty())
+    {
+        client.requests.pop_front();
+        queueResponse(client, std::move(failure), false);
+        return false;
+    }
+    client.backendRunning = true;
+    watchConnection(client, 0);
+    return true;
+}
+
+/* Hands the front request to a free worker of the pool, or queues it until one is free. Returns false if it could
+   be neither, in which case an error response has been queued instead */
+bool WebServer::startPooledCgi(Connection &client, CGIPool &pool)
+{
+    CGIPool::Worker *worker = nullptr;
+    int             errorCode = 503;
+
+    try
+    {
+        worker = pool.dispatch(client.requests.front());
+        if (worker)
         {
-            CGIHandler cgiHandler(request, *this);
-            epoll_ctl(_epollFd, EPOLL_CTL_DEL, clientSocket, nullptr); // Only delete from epoll, don't close()
+            CGIProcessInfo cgiInfo;
+
+            cgiInfo.pid = worker->pid;
+            cgiInfo.clientSocket = client.fd;
+            cgiInfo.startTime = std::chrono::steady_clock::now();
+            cgiInfo.readFromCgiFd = worker->responseFd;
+            cgiInfo.writeToCgiFd = -1;
+            cgiInfo.stream = CGIStream(client.requests.front().getRequestData().method == "HEAD");
+            cgiInfo.pool = &pool;
+            cgiInfo.worker = worker;
+            registerCgiProcess(cgiInfo);
         }
-        else
+        if (worker || pool.enqueue(client.fd))
         {
-            epollController(clientSocket, EPOLL_CTL_MOD, EPOLLOUT, FdType::CLIENT);
+            _timers.cancel(client.fd);
+            client.backendRunning = true;
+            watchConnection(client, 0);
+            return true;
         }
-        _partialRequests.erase(clientSocket);
-    };
+        std::cout << COLOR_YELLOW_CGI << "  CGI pool is full, request turned away 🐍\n\n" << COLOR_RESET;
+    }
+    catch (const std::exception &e)
+    {
+        WebErrors::printerror("WebServer::startPooledCgi", e.what());
+        if (worker)
+            pool.replace(*worker);
+        errorCode = 500;
+    }
 
-    try
+    std::string response;
+    ErrorHandler(client.requests.front().getServer()).handleError(response, errorCode);
+    client.backendRunning = false;
+    client.requests.pop_front();
+    queueResponse(client, std::move(response), false);
+    return false;
+}
+
+/* Starts forwarding the request at the front of the queue to a server of its upstream group, over HTTP for
+   proxy_pass or FastCGI for fastcgi_pass. The upstream socket is driven by its own epoll events. A server that
+   cannot even be connected to counts as failed and the next one is tried. Returns false if none could be, in which
+   case a 502 has been queued instead */
+bool WebServer::startProxy(Connection &client)
+{
+    const Request       &request = client.requests.front();
+    const RequestData   &data = request.getRequestData();
+    const std::string   &target = request.getLocation()->target;
+
+    while (client.proxyTries < proxyTryLimit(target))
     {
-        char    buffer[1024];
-        ssize_t bytesRead = recv(clientSocket, buffer, sizeof(buffer), 0);
+        UpstreamPeer    *peer = nullptr;
+        const addrinfo  *address = nullptr;
 
-        if (bytesRead > 0)
+        client.proxyTries++;
+        try
         {
-            _partialRequests[clientSocket].append(buffer, bytesRead);
+            peer = _balancer.choose(target, data.query_string.empty() ? data.uri : data.uri + "?" + data.query_string);
+            if (!peer)
+                throw WebErrors::ProxyException("No live upstream server for " + target);
 
-            while (isRequestComplete(_partialRequests[clientSocket]))
-            {
-                if (stopProcessing)
-                {
-                    cleanupClient(clientSocket);
-                    break;
-                }
-                std::string completeRequest = extractCompleteRequest(_partialRequests[clientSocket]);
-                _partialRequests[clientSocket].erase(0, completeRequest.length());
-                processRequest(clientSocket, completeRequest);
-            }
+            address = _resolver.lookup(peer->address);
+
+            std::unique_ptr<UpstreamHandler> proxy;
+
+            if (request.getLocation()->type == LocationType::FASTCGI)
+                proxy = std::make_unique<FastCGIHandler>(request, client.fd, _upstreamPool, address, peer->address);
+            else
+                proxy = std::make_unique<ProxyHandler>(request, client.fd, _upstreamPool, address, peer->address);
+
+            const int   upstreamSocket = proxy->getFd();
+            Connection  &upstream = addConnection(upstreamSocket, FdType::UPSTREAM);
+
+            upstream.server = client.server;
+            upstream.proxy = std::move(proxy);
+            upstream.peer = peer;
+            upstream.events = upstream.proxy->getWantedEvents();
+            epollController(upstreamSocket, EPOLL_CTL_ADD, upstream.events, FdType::UPSTREAM);
+            client.upstreamFd = upstreamSocket;
+            _timers.cancel(client.fd);
+            _timers.schedule(upstreamSocket, PROXY_TIMEOUT, std::chrono::seconds(PROXY_TIMEOUT_LIMIT));
+            client.backendRunning = true;
+            watchConnection(client, 0);
+            return true;
         }
-        else if (bytesRead == 0)
+        catch (const std::exception &e)
         {
-            cleanupClient(clientSocket);
+            WebErrors::printerror("WebServer::startProxy", e.what());
+            if (!peer)
+                break;
+            _resolver.reportFailure(peer->address, address);
+            _balancer.release(*peer, true, std::chrono::steady_clock::now());
         }
-        else if (bytesRead == -1)
+    }
+
+    std::string response;
+    ErrorHandler(request.getServer()).handleError(response, 502);
+    client.requests.pop_front();
+    client.proxyTries = 0;
+    queueResponse(client, std::move(response), false);
+    return false;
+}
+
+/* Edge-triggered, responses queued once the queue has been flushed bring no new EPOLLOUT: they are written right away */
+void WebServer::handleOutgoingData(int clientSocket)
+{
+    try
+    {
+        Connection                  *client = getConnection(clientSocket, FdType::CLIENT);
+        OutputQueue::FlushStatus    status;
+
+        do
         {
-            cleanupClient(clientSocket);
-            throw std::runtime_error("Error receiving data from client");
-        }
+            status = client->output.flush(clientSocket);
+            if (status != OutputQueue::FAILED && client->upstreamFd != -1)
+                resumeUpstream(*client);
+            if (status != OutputQueue::FAILED && client->cgiPipeFd != -1)
+                resumeCgi(*client);
+            switch (status)
+            {
+                case OutputQueue::PENDING:
+                    _timers.schedule(clientSocket, SEND_TIMEOUT, std::chrono::seconds(client->server->send_timeout));
+                    break;
+                case OutputQueue::FAILED:
+                    cleanupClient(clientSocket);
+                    throw std::runtime_error("Error sending response to client");
+                case OutputQueue::FLUSHED:
+                    finishClientResponse(*client);
+                    break;
+            }
+        } while (_edgeTriggered && status == OutputQueue::FLUSHED
+            && (client = getConnection(clientSocket, FdType::CLIENT)) && !client->output.empty());
     }
     catch (const std::exception &e)
     {
-        try {
-            ErrorHandler(&_parser.getServers().front()).handleError(_partialRequests[clientSocket], 400);
-            const int ret = send(clientSocket, _partialRequests[clientSocket].c_str(), _partialRequests[clientSocket].length(), 0);
-            if (ret == -1)
-                std::cerr << COLOR_RED_ERROR << "Error sending 400 response to client: " << strerror(errno) << "\n\n" << COLOR_RESET;
-            else if (ret == 0)
-                std::cerr << COLOR_RED_ERROR << "Error sending 400 response to client, Connection closed by the client: " << strerror(errno) << "\n\n" << COLOR_RESET;
-            cleanupClient(clientSocket);
-        } catch (const std::exception &inner_e) {
-            WebErrors::combineExceptions(e, inner_e);
-            throw e;
-        }
-        throw ;
+        cleanupClient(clientSocket);
+        throw;
     }
 }
 
-void WebServer::handleOutgoingData(int clientSocket)
+/* Closes the connection, whether or not the socket is still registered in epoll (it is not while a CGI script runs),
+   along with the upstream connection still answering it */
+void WebServer::cleanupClient(int clientSocket)
 {
-    try
+    Connection *client = getConnection(clientSocket, FdType::CLIENT);
+
+    if (!client)
+        return;
+    if (client->upstreamFd != -1)
+        detachUpstream(*client, false);
+    if (client->backendRunning) // a pool worker still running the script for it has its response dropped
     {
-        auto          it = _requestMap.find(clientSocket);
-        if (it != _requestMap.end())
+        Connection *pipe = getConnection(client->cgiPipeFd, FdType::CGI_PIPE);
+
+        for (auto &[script, pool] : _cgiPools)
+            pool->cancel(clientSocket);
+        for (CGIProcessInfo &cgiInfo : _cgiInfoList)
         {
-            const Request &request = it->second;
-            Response res(request);
+            if (cgiInfo.clientSocket == clientSocket)
+                cgiInfo.clientSocket = -1;
+        }
+        if (pipe && !pipe->cgiInfo->pool) // a script of its own is killed, it could hang with nothing left to stop it
+            stopCgi(pipe->cgiInfo, true);
+    }
+    epoll_ctl(_epollFd, EPOLL_CTL_DEL, clientSocket, nullptr);
+    removeConnection(clientSocket);
+    close(clientSocket);
+}
 
-            const int bytesSent = send(clientSocket, res.getResponse().c_str(), res.getResponse().length(), 0);
+/* Only touches epoll when the set of events actually changes, 0 takes the socket (client or upstream) out of epoll */
+void WebServer::watchConnection(Connection &connection, uint32_t events)
+{
+    if (connection.events == events)
+        return;
+    if (events == 0)
+        epoll_ctl(_epollFd, EPOLL_CTL_DEL, connection.fd, nullptr); // Only delete from epoll, don't close()
+    else
+        epollController(connection.fd, connection.events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, events, connection.type);
+    connection.events = events;
+}
 
-            if (bytesSent == -1)
-            {
-                epollController(clientSocket, EPOLL_CTL_DEL, 0, FdType::CLIENT);
-                throw std::runtime_error("Error sending response to client");
-            }
-            else if (bytesSent == 0)
+/* Appends a response behind the ones already waiting, it is written out on the following EPOLLOUT events.
+   Once a response that closes the connection is queued, nothing after it gets answered */
+void WebServer::queueResponse(Connection &client, std::string response, bool keepAlive, ResponseBody body)
+{
+    setConnectionHeader(response, keepAlive);
+    client.output.push(std::move(response));
+    client.output.pushShared(std::move(body.data));
+    client.output.pushFile(std::move(body.file), body.size);
+    endResponse(client, keepAlive);
+}
+
+/* The response to the front request is complete in the output queue (or has partly been sent already) */
+void WebServer::endResponse(Connection &client, bool keepAlive)
+{
+    client.requestCount++;
+    if (!keepAlive)
+    {
+        client.closing = true;
+        client.requests.clear();
+    }
+    watchConnection(client, EPOLLOUT);
+    _timers.schedule(client.fd, SEND_TIMEOUT, std::chrono::seconds(client.server->send_timeout));
+}
+
+/* Once everything queued has been sent, either close, or go on with requests that were pipelined behind it */
+void WebServer::finishClientResponse(Connection &client)
+{
+    if (client.closing)
+        return cleanupClient(client.fd);
+
+    parseRequests(client);
+    serveRequests(client);
+}
+
+bool WebServer::shouldKeepAlive(const Connection &client, const Request &request, const std::string &response) const
+{
+    const Server *server = request.getServer() ? request.getServer() : client.server;
+    if (server->keepalive_timeout <= 0 || client.requestCount + 1 >= static_cast<size_t>(server->keepalive_requests))
+        return false;
+
+    // The body of a rejected request may still be sitting unread in the socket. Only HTTP/1.1 gets this far,
+    // other versions are answered 505 and closed
+    const int errorCode = request.getErrorCode();
+    if (errorCode == BAD_REQUEST || errorCode == REQUEST_BODY_TOO_LARGE || errorCode == URI_TOO_LONG
+        || errorCode == REQUEST_HEADER_FIELDS_TOO_LARGE || errorCode == HTTP_VERSION_NOT_SUPPORTED)
+        return false;
+
+    const RequestData &requestData = request.getRequestData();
+    auto               connectionIt = requestData.headers.find("Connection");
+    std::string        connection = connectionIt != requestData.headers.end() ? WebParser::trimSpaces(connectionIt->second) : "";
+
+    std::transform(connection.begin(), connection.end(), connection.begin(), ::tolower);
+    if (connection == "close")
+        return false;
+
+    // Without a Content-Length or chunks the client can only find the end of the response by the connection closing,
+    // unless it has no body at all: an answer to HEAD, a 204 or a 304 (RFC 9112 6.3)
+    const size_t statusStart = response.find(' ');
+    const int status = statusStart != std::string::npos ? std::atoi(response.c_str() + statusStart + 1) : 0;
+    const bool bodyless = requestData.method == "HEAD" || status == 204 || status == 304;
+    std::string responseConnection = getResponseHeader(response, "Connection");
+    std::string transferEncoding = getResponseHeader(response, "Transfer-Encoding");
+    std::transform(responseConnection.begin(), responseConnection.end(), responseConnection.begin(), ::tolower);
+    std::transform(transferEncoding.begin(), transferEncoding.end(), transferEncoding.begin(), ::tolower);
+    const bool chunked = transferEncoding.length() >= 7
+        && transferEncoding.compare(transferEncoding.length() - 7, 7, "chunked") == 0;
+    return responseConnection != "close" && (bodyless || chunked || !getResponseHeader(response, "Content-Length").empty());
+}
+
+/* Case-insensitive lookup in the header section of a response, returns an empty string if the header is not there */
+std::string WebServer::getResponseHeader(const std::string &response, const std::string &name)
+{
+    size_t lineStart = response.find('\n');
+
+    while (lineStart != std::string::npos && lineStart + 1 < response.length())
+    {
+        lineStart++;
+        size_t      lineEnd = response.find('\n', lineStart);
+        std::string line = response.substr(lineStart, lineEnd == std::string::npos ? std::string::npos : lineEnd - lineStart);
+
+        if (line.empty() || line == "\r")
+            break;
+        size_t colonPos = line.find(':');
+        if (colonPos == name.length() && strncasecmp(line.c_str(), name.c_str(), name.length()) == 0)
+            return WebParser::trimSpaces(line.substr(colonPos + 1));
+        lineStart = lineEnd;
+    }
+    return "";
+}
+
+/* Replaces any Connection header already in the response (proxied and CGI responses bring their own) */
+void WebServer::setConnectionHeader(std::string &response, bool keepAlive)
+{
+    size_t statusLineEnd = response.find('\n');
+
+    if (statusLineEnd == std::string::npos)
+        return;
+    size_t lineStart = statusLineEnd + 1;
+    while (lineStart < response.length())
+    {
+        size_t lineEnd = response.find('\n', lineStart);
+        if (lineEnd == std::string::npos || lineEnd == lineStart || (lineEnd == lineStart + 1 && response[lineStart] == '\r'))
+            break;
+        if (strncasecmp(response.c_str() + lineStart, "Connection:", 11) == 0)
+            response.erase(lineStart, lineEnd + 1 - lineStart);
+        else
+            lineStart = lineEnd + 1;
+    }
+    response.insert(statusLineEnd + 1, keepAlive ? "Connection: keep-alive\r\n" : "Connection: close\r\n");
+}
+
+/* Reads what the script wrote. The output of a script run in its own process is passed on to the client as it
+   comes, and reading stops while PROXY_BUFFER_SIZE bytes wait for the client, so a long output never sits in
+   memory whole. CGI_TIMEOUT_LIMIT is then the longest the script may stay silent. A pool worker frames its
+   response, it is passed on once whole */
+void WebServer::handleCGIinteraction(int pipeFd)
+{
+    Connection  &pipe = *getConnection(pipeFd, FdType::CGI_PIPE);
+    auto        it = pipe.cgiInfo;
+    Connection  *client = getConnection(it->clientSocket, FdType::CLIENT);
+    ssize_t     bytes = 0;
+    bool        ended = false;
+
+    try
+    {
+        while (!ended)
+        {
+            bytes = read(pipeFd, _readBuffer.data(), _readBuffer.size());
+            if (bytes == -1 && errno == EINTR)
+                continue;
+            if (bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if (bytes == -1)
+                throw std::runtime_error("Error reading from CGI output pipe");
+            ended = bytes == 0;
+            if (bytes > 0 && it->pool)
             {
-                epollController(clientSocket, EPOLL_CTL_DEL, 0, FdType::CLIENT);
-                throw std::runtime_error("Connection closed by the client");
+                it->response.append(_readBuffer.data(), bytes);
+                ended = CGIPool::takeOutput(it->response, it->stream);
             }
-            else
-                epollController(clientSocket, EPOLL_CTL_DEL, 0, FdType::CLIENT);
+            else if (bytes > 0)
+                it->stream.append(_readBuffer.data(), bytes);
+            if (bytes > 0 && client)
+                forwardCgiOutput(*it, *client);
+            else if (bytes > 0) // a pool worker's client has gone, the rest of its output is dropped
+                it->stream.take();
+            if (!_edgeTriggered || (client && client->output.size() >= PROXY_BUFFER_SIZE))
+                break;
         }
-        _requestMap.erase(it);
     }
     catch (const std::exception &e)
     {
-        try {
-            epollController(clientSocket, EPOLL_CTL_DEL, 0, FdType::CLIENT);
-        } catch (const std::exception &inner_e) {
-            WebErrors::combineExceptions(e, inner_e);
+        WebErrors::printerror("WebServer::handleCGIinteraction", e.what());
+        return abortCgi(it, 502, true);
+    }
+    if (ended && bytes == 0 && it->pool) // the worker died in the middle of the request
+        return abortCgi(it, 502, true);
+    if (ended && it->pidFd != -1) // how the script ended decides the end of the response, its timer keeps running
+    {
+        it->outputDone = true;
+        return watchConnection(pipe, 0);
+    }
+    if (ended)
+        return completeCgi(it);
+    if (client && client->output.size() >= PROXY_BUFFER_SIZE) // waiting for the client now
+    {
+        watchConnection(pipe, 0);
+        _timers.cancel(pipeFd);
+    }
+    else
+        _timers.schedule(pipeFd, CGI_TIMEOUT, std::chrono::seconds(CGI_TIMEOUT_LIMIT));
+}
+
+void WebServer::handleCGITimeout(int pipeFd)
+{
+    std::cout << COLOR_YELLOW_CGI << "  CGI Script Timed Out ⏰\n\n" << COLOR_RESET;
+    abortCgi(getConnection(pipeFd, FdType::CGI_PIPE)->cgiInfo, 504, true);
+}
+
+/* Writes as much of the body as the script has room for. The input pipe is only watched (EPOLLOUT) while the
+   script is behind, and it is closed once the body is written, so the script sees end of input. A script that
+   exits or closes its input early simply does not get the rest */
+void WebServer::writeCgiInput(cgiInfoList::iterator it)
+{
+    Connection *input = getConnection(it->writeToCgiFd, FdType::CGI_INPUT);
+    Connection *client = getConnection(it->clientSocket, FdType::CLIENT);
+
+    if (!client)
+        return closeCgiInput(it);
+
+    const std::string &body = client->requests.front().getRequestData().body;
+
+    while (it->bodySent < body.size())
+    {
+        const ssize_t written = write(it->writeToCgiFd, body.data() + it->bodySent, body.size() - it->bodySent);
+
+        if (written == -1 && errno == EINTR)
+            continue;
+        if (written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            watchConnection(*input, EPOLLOUT);
+            if (getConnection(it->readFromCgiFd, FdType::CGI_PIPE)->events != 0) // the script is busy reading, not stuck
+                _timers.schedule(it->readFromCgiFd, CGI_TIMEOUT, std::chrono::seconds(CGI_TIMEOUT_LIMIT));
+            return;
         }
-        throw;
+        if (written == -1)
+        {
+            if (errno != EPIPE)
+                WebErrors::printerror("WebServer::writeCgiInput", "Error writing to CGI input pipe");
+            break;
+        }
+        it->bodySent += written;
     }
+    closeCgiInput(it);
 }
 
-void WebServer::handleCGIinteraction(int pipeFd)
+void WebServer::closeCgiInput(cgiInfoList::iterator it)
+{
+    if (getConnection(it->writeToCgiFd, FdType::CGI_INPUT)->events != 0)
+        epoll_ctl(_epollFd, EPOLL_CTL_DEL, it->writeToCgiFd, nullptr);
+    removeConnection(it->writeToCgiFd);
+    close(it->writeToCgiFd);
+    it->writeToCgiFd = -1;
+}
+
+/* Queues what the script's output gave since the last call. Whether the client connection stays open is
+   settled on the head */
+void WebServer::forwardCgiOutput(CGIProcessInfo &cgiInfo, Connection &client)
+{
+    const bool  first = !cgiInfo.stream.hasForwarded();
+    std::string data = cgiInfo.stream.take();
+
+    if (data.empty())
+        return;
+    if (first)
+    {
+        cgiInfo.keepAlive = shouldKeepAlive(client, client.requests.front(), data);
+        setConnectionHeader(data, cgiInfo.keepAlive);
+    }
+    client.output.push(std::move(data));
+    watchConnection(client, EPOLLOUT);
+    _timers.schedule(client.fd, SEND_TIMEOUT, std::chrono::seconds(client.server->send_timeout));
+}
+
+/* Reading from the script starts again once the client has taken half of what was waiting */
+void WebServer::resumeCgi(Connection &client)
 {
+    Connection *pipe = getConnection(client.cgiPipeFd, FdType::CGI_PIPE);
+
+    if (!pipe || pipe->events != 0 || client.output.size() > PROXY_BUFFER_SIZE / 2)
+        return;
+    watchConnection(*pipe, EPOLLIN);
+    _timers.schedule(pipe->fd, CGI_TIMEOUT, std::chrono::seconds(CGI_TIMEOUT_LIMIT));
+}
+
+/* The script's output is complete, and its process has exited if it had one: the rest of the output is queued,
+   and the client goes on with its next request */
+void WebServer::completeCgi(cgiInfoList::iterator it)
+{
+    Connection *client = getConnection(it->clientSocket, FdType::CLIENT);
+
+    if (it->exited && WIFSIGNALED(it->exitStatus)) // a crash, or the OOM killer: what it wrote may be cut short
+    {
+        std::cerr << COLOR_RED_ERROR << "  CGI script killed by signal " << WTERMSIG(it->exitStatus) << " 💥\n\n" << COLOR_RESET;
+        return abortCgi(it, 502, false);
+    }
+    // a failure, such as a traceback, before anything was sent: what it printed is not trusted to be a response
+    if (it->exited && WIFEXITED(it->exitStatus) && WEXITSTATUS(it->exitStatus) != 0 && !it->stream.hasForwarded())
+    {
+        std::cerr << COLOR_RED_ERROR << "  CGI script exited with status " << WEXITSTATUS(it->exitStatus)
+                  << " before its response went out 💥\n\n" << COLOR_RESET;
+        return abortCgi(it, 502, false);
+    }
     try
     {
-        for (auto it = _cgiInfoList.begin(); it != _cgiInfoList.end(); ++it)
-        {
-            if (it->readFromCgiFd == pipeFd)
+        it->stream.finish();
+    }
+    catch (const std::exception &e)
+    {
+        WebErrors::printerror("WebServer::completeCgi", e.what()); // a script that failed has its traceback in the log
+        return abortCgi(it, 502, false);
+    }
+    if (client)
+        forwardCgiOutput(*it, *client);
+
+    const bool keepAlive = it->keepAlive;
+
+    stopCgi(it, false);
+    if (!client)
+        return;
+    client->cgiPipeFd = -1;
+    client->requests.pop_front();
+    client->backendRunning = false;
+    endResponse(*client, keepAlive);
+}
+
+/* The client gets the error instead of the script's response, unless part of it already went out: then only
+   closing the connection can tell it the response is cut short */
+void WebServer::abortCgi(cgiInfoList::iterator it, int errorCode, bool killScript)
+{
+    Connection  *client = getConnection(it->clientSocket, FdType::CLIENT);
+    const bool  forwarded = it->stream.hasForwarded();
+    std::string response;
+
+    stopCgi(it, killScript);
+    if (!client)
+        return;
+    client->cgiPipeFd = -1;
+    client->backendRunning = false;
+    if (forwarded)
+        return cleanupClient(client->fd);
+    ErrorHandler(client->requests.front().getServer()).handleError(response, errorCode);
+    queueResponse(*client, std::move(response), false);
+}
+
+/* Ends the job: its pipes are closed, the script is killed if `killScript` (a pool worker is replaced instead).
+   Its process stays watched until it is reaped */
+void WebServer::stopCgi(cgiInfoList::iterator it, bool killScript)
+{
+    if (it->pool)
+        return releaseCgiWorker(it, killScript);
+    if (killScript && kill(it->pid, SIGKILL) == -1)
+        std::cerr << COLOR_RED_ERROR << "Failed to kill CGI process: " << strerror(errno) << "\n\n" << COLOR_RESET;
+    if (it->writeToCgiFd != -1)
+        closeCgiInput(it);
+    if (it->pidFd != -1) // still reaped once it exits
+        getConnection(it->pidFd, FdType::CGI_PROCESS)->cgiInfo = _cgiInfoList.end();
+    if (getConnection(it->readFromCgiFd, FdType::CGI_PIPE)->events != 0)
+        epoll_ctl(_epollFd, EPOLL_CTL_DEL, it->readFromCgiFd, nullptr);
+    removeConnection(it->readFromCgiFd);
+    close(it->readFromCgiFd);
+    _cgiInfoList.erase(it);
+}
+
+/* A pooled job is over: the worker waits for the next request, or is replaced if it died or timed out. Its pipes
+   stay open with the pool, only their connection goes. The worker is then handed to the first queued client */
+void WebServer::releaseCgiWorker(cgiInfoList::iterator it, bool replace)
+{
+    CGIPool         &pool = *it->pool;
+    CGIPool::Worker &worker = *it->worker;
+
+    epoll_ctl(_epollFd, EPOLL_CTL_DEL, it->readFromCgiFd, nullptr);
+    removeConnection(it->readFromCgiFd);
+    _cgiInfoList.erase(it);
+    if (replace)
+        pool.replace(worker);
+    else
+        pool.release(worker);
+    for (int clientSocket = pool.dequeue(); clientSocket != -1; clientSocket = pool.dequeue())
+    {
+        Connection *client = getConnection(clientSocket, FdType::CLIENT);
+
+        if (client && startPooledCgi(*client, pool))
+            break;
+    }
+}
+
+void WebServer::handleUpstreamEvent(int upstreamSocket, uint32_t events)
+{
+    Connection      &upstream = *getConnection(upstreamSocket, FdType::UPSTREAM);
+    UpstreamHandler &proxy = *upstream.proxy;
+    Connection      &client = *getConnection(proxy.getClientSocket(), FdType::CLIENT);
+    const size_t    room = PROXY_BUFFER_SIZE - std::min(client.output.size(), static_cast<size_t>(PROXY_BUFFER_SIZE));
+
+    switch (proxy.handleEvent(events, _readBuffer, _edgeTriggered, room))
+    {
+        case UpstreamHandler::IN_PROGRESS:
+            forwardProxyResponse(upstream, client);
+            watchConnection(upstream, client.output.size() >= PROXY_BUFFER_SIZE ? 0 : proxy.getWantedEvents());
+            if (upstream.events == 0) // waiting for the client now, its send_timeout runs instead
+                _timers.cancel(upstreamSocket);
+            else
+                _timers.schedule(upstreamSocket, PROXY_TIMEOUT, std::chrono::seconds(PROXY_TIMEOUT_LIMIT));
+            break;
+        case UpstreamHandler::DONE:
+            finishProxy(upstream, client);
+            break;
+        case UpstreamHandler::FAILED:
+            if (proxy.canRetry()) // try again on another connection, to another server if there is one left
             {
-                char    buffer[4096];
-                ssize_t bytes = read(pipeFd, buffer, sizeof(buffer));
+                const bool stale = proxy.isStale();
 
-                if (bytes > 0)
-                    it->response.append(buffer, bytes);
-                else if (bytes == 0)
-                {
-                    const int clientSocket = it->clientSocket;
-                    epollController(pipeFd, EPOLL_CTL_DEL, 0, FdType::CGI_PIPE);
-                    const int   ret = send(clientSocket, it->response.c_str(), it->response.length(), 0);
-                    if (ret == -1)
-                        std::cerr << COLOR_RED_ERROR << "Error sending 504 response to client: " << strerror(errno) << "\n\n" << COLOR_RESET;
-                    else if (ret == 0)
-                        std::cerr << COLOR_RED_ERROR << "Error sending Cgi response to client, Connection closed by the client: " << strerror(errno) << "\n\n" << COLOR_RESET;
-                    close(clientSocket);
-                    _cgiInfoList.erase(it);
-                    _requestMap.erase(clientSocket);
-                }
-                else if (bytes == -1)
-                    throw std::runtime_error("Error reading from CGI output pipe");
+                if (stale) // a pooled connection the upstream had just closed does not count as a try
+                    client.proxyTries--;
+                if (proxy.isConnecting())
+                    _resolver.reportFailure(proxy.getUpstream(), proxy.getAddress());
+                detachUpstream(client, !stale);
+                client.backendRunning = false;
+                startProxy(client);
                 break;
             }
-        }
+            abortProxy(upstreamSocket, 502);
+            break;
     }
-    catch (std::exception &e)
+}
+
+/* Every address of every server of the target gets a try */
+size_t WebServer::proxyTryLimit(const std::string &target) const
+{
+    size_t limit = 0;
+
+    for (const std::string &address : _balancer.addresses(target))
+        limit += _resolver.addressCount(address);
+    return limit;
+}
+
+/* Queues what the upstream sent since the last call, so the client gets the response while it is still arriving.
+   Whether the client connection stays open is settled on the head */
+void WebServer::forwardProxyResponse(Connection &upstream, Connection &client)
+{
+    const bool  first = !upstream.proxy->hasForwarded();
+    std::string data = upstream.proxy->takeResponse();
+
+    if (data.empty())
+        return;
+    if (first)
     {
-        throw;
+        upstream.keepAlive = shouldKeepAlive(client, client.requests.front(), data);
+        setConnectionHeader(data, upstream.keepAlive);
+    }
+    client.output.push(std::move(data));
+    watchConnection(client, EPOLLOUT);
+    _timers.schedule(client.fd, SEND_TIMEOUT, std::chrono::seconds(client.server->send_timeout));
+}
+
+/* Reading from the upstream stops while PROXY_BUFFER_SIZE bytes wait for the client, and starts again once the
+   client has taken half of them */
+void WebServer::resumeUpstream(Connection &client)
+{
+    Connection &upstream = *getConnection(client.upstreamFd, FdType::UPSTREAM);
+
+    if (upstream.events != 0 || client.output.size() > PROXY_BUFFER_SIZE / 2)
+        return;
+    watchConnection(upstream, upstream.proxy->getWantedEvents());
+    _timers.schedule(upstream.fd, PROXY_TIMEOUT, std::chrono::seconds(PROXY_TIMEOUT_LIMIT));
+}
+
+void WebServer::handleProxyTimeout(int upstreamSocket)
+{
+    std::cout << COLOR_RED_ERROR << "  Proxy server took too long to respond ⏰\n\n" << COLOR_RESET;
+    abortProxy(upstreamSocket, 504);
+}
+
+/* The whole response has been received: the rest of it is queued, and the upstream socket goes back to the pool
+   if the response left it reusable */
+void WebServer::finishProxy(Connection &upstream, Connection &client)
+{
+    forwardProxyResponse(upstream, client);
+
+    const bool keepAlive = upstream.keepAlive;
+
+    if (upstream.events != 0)
+        epoll_ctl(_epollFd, EPOLL_CTL_DEL, upstream.fd, nullptr);
+    upstream.events = 0;
+    if (upstream.proxy->isReusable())
+        _upstreamPool.release(upstream.proxy->getUpstream(), upstream.proxy->releaseSocket(), upstream.proxy->getRequestsServed());
+    detachUpstream(client, false);
+    client.requests.pop_front();
+    client.proxyTries = 0;
+    client.backendRunning = false;
+    endResponse(client, keepAlive);
+}
+
+/* The client gets the error instead of the response, unless part of the response already went out:
+   then only closing the connection can tell it the response is cut short */
+void WebServer::abortProxy(int upstreamSocket, int errorCode)
+{
+    const UpstreamHandler   &proxy = *getConnection(upstreamSocket, FdType::UPSTREAM)->proxy;
+    Connection              &client = *getConnection(proxy.getClientSocket(), FdType::CLIENT);
+    std::string             response;
+
+    const bool              peerFailed = errorCode == 504 || !proxy.isStale();
+
+    if (proxy.hasForwarded())
+    {
+        detachUpstream(client, peerFailed);
+        return cleanupClient(client.fd);
     }
+    ErrorHandler(client.requests.front().getServer()).handleError(response, errorCode);
+
+    const bool keepAlive = shouldKeepAlive(client, client.requests.front(), response);
+
+    detachUpstream(client, peerFailed);
+    client.requests.pop_front();
+    client.proxyTries = 0;
+    client.backendRunning = false;
+    queueResponse(client, std::move(response), keepAlive);
+}
+
+/* Takes the upstream socket answering the client out of epoll and closes it, unless it went back to the pool.
+   The server it was connected to is told how the request went */
+void WebServer::detachUpstream(Connection &client, bool peerFailed)
+{
+    Connection *upstream = getConnection(client.upstreamFd, FdType::UPSTREAM);
+
+    if (upstream && upstream->events != 0)
+        epoll_ctl(_epollFd, EPOLL_CTL_DEL, upstream->fd, nullptr);
+    if (upstream && upstream->peer)
+        _balancer.release(*upstream->peer, peerFailed, std::chrono::steady_clock::now());
+    removeConnection(client.upstreamFd); // the handler closes the socket
+    client.upstreamFd = -1;
+}
+
+/* A client that is too slow to send its request gets a 408, one that stops reading the response or stays idle
+   between two requests is simply dropped */
+void WebServer::handleClientTimeout(int clientSocket, TimerType type)
+{
+    Connection &client = *getConnection(clientSocket, FdType::CLIENT);
+
+    if (type == SEND_TIMEOUT || type == KEEPALIVE_TIMEOUT)
+        return cleanupClient(clientSocket);
+
+    std::cout << COLOR_RED_ERROR << "  Client took too long to send its request ⏰\n\n" << COLOR_RESET;
+    std::string response;
+    ErrorHandler(client.server).handleError(response, 408);
+    client.partialRequest.clear();
+    client.parser.reset();
+    queueResponse(client, response, false);
 }
 
-void WebServer::CGITimeoutChecker(void)
+/* Every timeout in the server lives in the timer wheel, so only the fds that actually expired are visited */
+void WebServer::handleTimeouts(void)
 {
-    try 
+    const auto now = std::chrono::steady_clock::now();
+
+    _upstreamPool.prune(now);
+    for (const std::string &upstream : _resolver.collect())
+        _upstreamPool.discard(upstream);
+    startHealthChecks(now);
+    for (const auto &[fd, type] : _timers.advance(now))
     {
-        auto now = std::chrono::steady_clock::now();
+        try
+        {
+            if (type == CGI_TIMEOUT && getConnection(fd, FdType::CGI_PIPE))
+                handleCGITimeout(fd);
+            else if (type == PROXY_TIMEOUT && getConnection(fd, FdType::UPSTREAM))
+                handleProxyTimeout(fd);
+            else if (type == HEALTH_CHECK_TIMEOUT && getConnection(fd, FdType::HEALTH_CHECK))
+                finishHealthCheck(fd, false);
+            else if (type != CGI_TIMEOUT && type != PROXY_TIMEOUT && type != HEALTH_CHECK_TIMEOUT
+                && getConnection(fd, FdType::CLIENT))
+                handleClientTimeout(fd, type);
+        }
+        catch (const std::exception &e)
+        {
+            WebErrors::printerror("WebServer::handleTimeouts", e.what());
+        }
+    }
+}
 
-        for (auto it = _cgiInfoList.begin(); it != _cgiInfoList.end();)
+/* Each due health check gets its own socket in epoll, a server that cannot even be connected to fails at once */
+void WebServer::startHealthChecks(std::chrono::steady_clock::time_point now)
+{
+    for (const UpstreamBalancer::HealthCheck &check : _balancer.dueHealthChecks(now))
+    {
+        try
         {
-            auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(now - it->startTime).count();
+            auto        probe = std::make_unique<HealthProbe>(_resolver.lookup(check.peer->address), *check.peer, check.uri);
+            const int   probeSocket = probe->getFd();
+            Connection  &connection = addConnection(probeSocket, FdType::HEALTH_CHECK);
 
-            if (elapsed > CGI_TIMEOUT_LIMIT)
+            connection.probe = std::move(probe);
+            connection.events = connection.probe->getWantedEvents();
+            epollController(probeSocket, EPOLL_CTL_ADD, connection.events, FdType::HEALTH_CHECK);
+            _timers.schedule(probeSocket, HEALTH_CHECK_TIMEOUT, std::chrono::seconds(HEALTH_CHECK_TIMEOUT_LIMIT));
+        }
+        catch (const std::exception &) // logged once, by the change of state
+        {
+            _balancer.reportHealthCheck(*check.peer, false);
+        }
+    }
+}
+
+void WebServer::handleHealthCheckEvent(int probeSocket, uint32_t events)
+{
+    Connection &connection = *getConnection(probeSocket, FdType::HEALTH_CHECK);
+
+    switch (connection.probe->handleEvent(events))
+    {
+        case HealthProbe::IN_PROGRESS:
+            watchConnection(connection, connection.probe->getWantedEvents());
+            break;
+        case HealthProbe::HEALTHY:
+            finishHealthCheck(probeSocket, true);
+            break;
+        case HealthProbe::UNHEALTHY:
+            finishHealthCheck(probeSocket, false);
+            break;
+    }
+}
+
+void WebServer::finishHealthCheck(int probeSocket, bool healthy)
+{
+    Connection &connection = *getConnection(probeSocket, FdType::HEALTH_CHECK);
+
+    _balancer.reportHealthCheck(connection.probe->getPeer(), healthy);
+    epoll_ctl(_epollFd, EPOLL_CTL_DEL, probeSocket, nullptr);
+    removeConnection(probeSocket); // the HealthProbe closes the socket
+}
+
+/* Called by CGIHandler once the script is running: its output pipe, its process, and its input pipe if it has a
+   body to write, get a connection pointing back at the job. If it throws, nothing of the job is left registered
+   and its fds are all still open, for the caller to close */
+void WebServer::registerCgiProcess(const CGIProcessInfo &cgiInfo)
+{
+    auto        it = _cgiInfoList.insert(_cgiInfoList.end(), cgiInfo);
+    Connection  *client = getConnection(cgiInfo.clientSocket, FdType::CLIENT);
+
+    try
+    {
+        watchCgiFd(it, cgiInfo.readFromCgiFd, FdType::CGI_PIPE, EPOLLIN);
+        if (!cgiInfo.pool)
+            watchCgiProcess(it);
+        if (cgiInfo.writeToCgiFd != -1)
+            watchCgiFd(it, cgiInfo.writeToCgiFd, FdType::CGI_INPUT, 0); // watched once the pipe is full
+    }
+    catch (const std::exception &e)
+    {
+        for (auto [fd, fdType] : {std::pair(it->readFromCgiFd, FdType::CGI_PIPE), std::pair(it->pidFd, FdType::CGI_PROCESS)})
+        {
+            if (getConnection(fd, fdType))
             {
-                std::cout << COLOR_YELLOW_CGI << "  CGI Script Timed Out ⏰\n\n" << COLOR_RESET;
-                if (kill(it->pid, SIGKILL) == -1)
-                    std::cerr << COLOR_RED_ERROR << "Failed to kill CGI process: " << strerror(errno) << "\n\n" << COLOR_RESET;
-                if (it->clientSocket >= 0 && fcntl(it->clientSocket, F_GETFD) != -1)
-                {  
-                    std::string response;
-                    ErrorHandler(_requestMap[it->clientSocket].getServer()).handleError(response, 504);
-                    const int   ret = send(it->clientSocket, response.c_str(), response.length(), 0);
-                    if (ret == -1)
-                        std::cerr << COLOR_RED_ERROR << "Error sending 504 response to client: " << strerror(errno) << "\n\n" << COLOR_RESET;
-                    else if (ret == 0)
-                        std::cerr << COLOR_RED_ERROR << "Error sending 504 response to client, Connection closed by the client: " << strerror(errno) << "\n\n" << COLOR_RESET;
-                    close(it->clientSocket);
-                }
-                if (_requestMap[it->clientSocket].getRequestData().method == "POST" && it->writeToCgiFd != -1)
-                    epollController(it->writeToCgiFd, EPOLL_CTL_DEL, 0, FdType::CGI_PIPE);
-                epollController(it->readFromCgiFd, EPOLL_CTL_DEL, 0, FdType::CGI_PIPE);
-                _requestMap.erase(it->clientSocket);
-                it = _cgiInfoList.erase(it);
+                epoll_ctl(_epollFd, EPOLL_CTL_DEL, fd, nullptr);
+                removeConnection(fd);
             }
-            else
-                ++it;
         }
+        if (it->pidFd != -1)
+            close(it->pidFd);
+        if (getConnection(it->writeToCgiFd, FdType::CGI_INPUT))
+            removeConnection(it->writeToCgiFd);
+        _cgiInfoList.erase(it);
+        throw;
+    }
+    if (client)
+        client->cgiPipeFd = cgiInfo.readFromCgiFd;
+    _timers.cancel(cgiInfo.clientSocket);
+    _timers.schedule(cgiInfo.readFromCgiFd, CGI_TIMEOUT, std::chrono::seconds(CGI_TIMEOUT_LIMIT));
+    if (cgiInfo.writeToCgiFd == -1)
+        return;
+    try
+    {
+        writeCgiInput(it);
+    }
+    catch (const std::exception &e) // epollController has closed the input pipe, the script sees its input end early
+    {
+        WebErrors::printerror("WebServer::registerCgiProcess", e.what());
+        it->writeToCgiFd = -1;
+    }
+}
+
+/* Like watchConnection for a new fd of a CGI job, except that the fd is left open if epoll refuses it: the job
+   setup is undone by registerCgiProcess, and the fd closed by its owner */
+Connection &WebServer::watchCgiFd(cgiInfoList::iterator it, int fd, FdType fdType, uint32_t events)
+{
+    Connection          &connection = addConnection(fd, fdType);
+    struct epoll_event  event;
+
+    connection.cgiInfo = it;
+    std::memset(&event, 0, sizeof(event));
+    event.data.u64 = (static_cast<uint64_t>(fdType) << 32) | static_cast<uint32_t>(fd);
+    event.events = events;
+    if (_edgeTriggered)
+        event.events |= EPOLLET;
+    if (events != 0 && epoll_ctl(_epollFd, EPOLL_CTL_ADD, fd, &event) == -1)
+    {
+        removeConnection(fd);
+        throw std::runtime_error("Error adding CGI fd to epoll: " + std::string(strerror(errno)));
+    }
+    if (fdType == FdType::CGI_PIPE)
+        std::cout << COLOR_GREEN_SERVER << " { CGI pipe added to epoll 🏊 }\n\n" << COLOR_RESET;
+    connection.events = events;
+    return connection;
+}
+
+/* The script's process is watched through a pidfd, which becomes readable when it exits: it is reaped right away,
+   without SIGCHLD or polling, and how it ended is known before its response is finished */
+void WebServer::watchCgiProcess(cgiInfoList::iterator it)
+{
+    const int pidFd = syscall(SYS_pidfd_open, it->pid, 0); // close-on-exec
+
+    if (pidFd == -1)
+    {
+        WebErrors::printerror("WebServer::watchCgiProcess", "pidfd_open failed, the script will not be reaped");
+        return;
+    }
+    try
+    {
+        watchCgiFd(it, pidFd, FdType::CGI_PROCESS, EPOLLIN).pid = it->pid;
     }
     catch (const std::exception &e)
     {
+        close(pidFd);
         throw;
     }
+    it->pidFd = pidFd;
+}
+
+/* Reaps the script. If its job is still on, the response is finished once its output has also ended */
+void WebServer::handleCGIExit(int pidFd)
+{
+    Connection  &process = *getConnection(pidFd, FdType::CGI_PROCESS);
+    auto        it = process.cgiInfo;
+    int         status = 0;
+
+    if (waitpid(process.pid, &status, WNOHANG) == 0)
+        return;
+    epollController(pidFd, EPOLL_CTL_DEL, 0, FdType::CGI_PROCESS);
+    if (it == _cgiInfoList.end())
+        return;
+    it->pidFd = -1;
+    it->exited = true;
+    it->exitStatus = status;
+    if (it->outputDone)
+        completeCgi(it);
 }
 
 void WebServer::handleEvents(int eventCount)
 {
     try
     {
-        auto getCorrectServerSocket = [this](int fd) -> bool {
-            return std::any_of(_serverSockets.begin(), _serverSockets.end(),
-                               [fd](const ScopedSocket& socket) { return socket.getFd() == fd; });
-        };
-        auto isCgiFd = [this](int fd) -> bool {
-            for (const auto& cgiInfo : _cgiInfoList)
-            {
-                if (cgiInfo.readFromCgiFd == fd || cgiInfo.writeToCgiFd == fd)
-                    return true;
-            }
-            return false;
-        };
-
         for (int i = 0; i < eventCount; ++i)
         {
-           _currentEventFd = _events[i].data.fd;
+            const FdType fdType = static_cast<FdType>(_events[i].data.u64 >> 32);
 
-            if (getCorrectServerSocket(_currentEventFd))
-            {
-                acceptAddClientToEpoll(_currentEventFd);
-            }
-            else if (isCgiFd(_currentEventFd))
-            {
-                handleCGIinteraction(_currentEventFd);
-            }
-            else
+            _currentEventFd = static_cast<int>(_events[i].data.u64 & 0xFFFFFFFF);
+            if (!getConnection(_currentEventFd, fdType))
+                continue;
+
+            switch (fdType)
             {
-                if (_events[i].events & EPOLLIN)
-                {
-                    handleIncomingData(_currentEventFd);
-                }
-                else if (_events[i].events & EPOLLOUT)
-                {
-                    handleOutgoingData(_currentEventFd);
-                }
+                case FdType::SERVER:
+                    acceptAddClientToEpoll(_currentEventFd);
+                    break;
+                case FdType::CGI_PIPE:
+                    handleCGIinteraction(_currentEventFd);
+                    break;
+                case FdType::CGI_INPUT:
+                    writeCgiInput(getConnection(_currentEventFd, FdType::CGI_INPUT)->cgiInfo);
+                    break;
+                case FdType::CGI_PROCESS:
+                    handleCGIExit(_currentEventFd);
+                    break;
+                case FdType::UPSTREAM:
+                    handleUpstreamEvent(_currentEventFd, _events[i].events);
+                    break;
+                case FdType::HEALTH_CHECK:
+                    handleHealthCheckEvent(_currentEventFd, _events[i].events);
+                    break;
+                case FdType::CLIENT:
+                    if (_events[i].events & EPOLLIN)
+                        handleIncomingData(_currentEventFd);
+                    else if (_events[i].events & EPOLLOUT)
+                        handleOutgoingData(_currentEventFd);
+                    break;
             }
         }
     }
@@ -530,7 +1400,11 @@ void WebServer::start()
     {
         try
         {
-            int eventCount = epoll_wait(_epollFd, _events.data(), MAX_EVENTS, 500);
+            int timeout = _timers.msUntilNextDeadline(std::chrono::steady_clock::now());
+            if (timeout == -1 || timeout > MAX_EPOLL_WAIT_MS)
+                timeout = MAX_EPOLL_WAIT_MS;
+
+            int eventCount = epoll_wait(_epollFd, _events.data(), MAX_EVENTS, timeout);
             if (eventCount == -1)
             {
                 if (errno == EINTR) continue;
@@ -538,21 +1412,28 @@ void WebServer::start()
             }
             if (eventCount > 0)
                 handleEvents(eventCount);
-            CGITimeoutChecker();
+            handleTimeouts();
         }
         catch (const std::exception &e)
         {
             WebErrors::printerror("WebServer::start", e.what());
         }
     }
-    std::cout << COLOR_GREEN_SERVER << "[ SERVER STOPPED ] 🔌\n" << COLOR_RESET;
+    if (_parser.getWorkerThreads() > 1)
+        std::cout << COLOR_GREEN_SERVER << "[ WORKER " << _workerId << " STOPPED ] 🔌\n" << COLOR_RESET;
+    else
+        std::cout << COLOR_GREEN_SERVER << "[ SERVER STOPPED ] 🔌\n" << COLOR_RESET;
+
+    const ResponseCache::Stats &stats = _responseCache.getStats();
+    std::cout << COLOR_GREEN_SERVER << "  Response cache: " << stats.hits << " hits, " << stats.misses << " misses, "
+              << stats.evictions << " evictions, " << _responseCache.getUsedBytes() << " bytes in use\n" << COLOR_RESET;
 }
 
 void  WebServer::signalHandler(int signal) { (void) signal; s_serverRunning = 0; }
 
-int WebServer::getEpollFd() const { return _epollFd; }
+void  WebServer::stop() { s_serverRunning = 0; }
 
-cgiInfoList& WebServer::getCgiInfoList() { return _cgiInfoList; }
+int WebServer::getEpollFd() const { return _epollFd; }
 
 int WebServer::getCurrentEventFd() const { return _currentEventFd; }
 
@@ -561,7 +1442,8 @@ void WebServer::setFdNonBlocking(int fd)
     int flags = fcntl(fd, F_GETFL, 0);
     if (flags == -1)
         throw std::runtime_error("Failed to get pipe flags");
-    flags |= O_NONBLOCK | FD_CLOEXEC;
-    if (fcntl(fd, F_SETFL, flags) == -1)
+    if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
         throw std::runtime_error("Failed to set non-blocking mode");
+    if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+        throw std::runtime_error("Failed to set close-on-exec flag");
 }
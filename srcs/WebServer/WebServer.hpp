@@ -5,7 +5,9 @@
 #include "WebParser.hpp"
 #include <csignal>
 #include <list>
+#include <memory>
 #include <netdb.h>
+#include <deque>
 #include <string>
 #include <netinet/in.h>
 #include <sys/poll.h>
@@ -14,8 +16,24 @@
 #include <unordered_map>
 #include <vector>
 #include "Request.hpp"
+#include "RequestParser.hpp"
+#include "OutputQueue.hpp"
+#include "TimerWheel.hpp"
+#include "FileCache.hpp"
+#include "ResponseCache.hpp"
+#include "Response.hpp"
+#include "ProxyHandler.hpp"
+#include "FastCGIHandler.hpp"
+#include "UpstreamPool.hpp"
+#include "UpstreamBalancer.hpp"
+#include "HealthProbe.hpp"
+#include "ProxyResolver.hpp"
+#include "CGIPool.hpp"
+#include "CGIStream.hpp"
 
 #define MAX_EVENTS 100
+#define MAX_PIPELINED_REQUESTS 32
+#define MAX_EPOLL_WAIT_MS 1000 // upper bound so that stop() is noticed by every worker
 
 #define COLOR_RED_ERROR "\033[31m"
 #define COLOR_CYAN_COOKIE "\033[36m"
@@ -27,20 +45,62 @@
 struct CGIProcessInfo
 {
     int         readFromCgiFd;
-    int         writeToCgiFd;
+    int         writeToCgiFd;                   // -1 once the body has been written (or there is none to write)
+    size_t      bodySent = 0;
     pid_t       pid;
+    int         pidFd = -1;                     // readable once the script's process exits, -1 once it is reaped
+    bool        exited = false;
+    int         exitStatus = 0;                 // from waitpid, once it has exited
+    bool        outputDone = false;             // its output reached EOF before the process was reaped
     int         clientSocket;
-    std::string response;
+    std::string response;                       // cgi_pool: the start of an output piece still coming
     std::chrono::steady_clock::time_point startTime;
+    CGIStream   stream;                         // the output, turned into the HTTP response as it comes
+    bool        keepAlive = false;              // the client connection stays open after the response
+    CGIPool         *pool = nullptr;            // set when a cgi_pool worker runs the script instead of its own process
+    CGIPool::Worker *worker = nullptr;
 };
 using cgiInfoList = std::list<CGIProcessInfo>;
 
-enum FdType  {SERVER, CLIENT, CGI_PIPE };
+enum FdType  {SERVER, CLIENT, CGI_PIPE, UPSTREAM, HEALTH_CHECK, CGI_INPUT, CGI_PROCESS };
+
+/* Everything the event loop knows about one fd. Connections are indexed directly by fd number,
+   and the type is also packed into epoll_event.data next to the fd, so dispatching an event is a lookup */
+struct Connection
+{
+    FdType                  type;
+    int                     fd;
+    const Server            *server = nullptr;       // SERVER: its config, CLIENT: the server it was accepted on
+
+    std::string             partialRequest;          // CLIENT
+    RequestParser           parser;                  // keeps its place in partialRequest between reads
+    std::deque<Request>     requests;                // parsed but not answered yet, in arrival order
+    OutputQueue             output;
+    uint32_t                events = 0;              // what the socket is registered for in epoll, 0 if it isn't (CLIENT, UPSTREAM)
+    bool                    backendRunning = false;  // the front request is being answered by a script or an upstream
+    bool                    closing = false;         // a response that ends the connection is queued
+    bool                    readPending = false;     // edge-triggered: reading stopped on a full queue, not at EAGAIN
+    int                     rejectCode = 0;          // error to answer once the requests before it are answered
+    const Server            *rejectServer = nullptr;
+    size_t                  requestCount = 0;
+    int                     upstreamFd = -1;         // the upstream socket answering the front request, if any
+    size_t                  proxyTries = 0;          // connections tried for the front request
+    int                     cgiPipeFd = -1;          // the output pipe of the script answering the front request, if any
+
+    cgiInfoList::iterator   cgiInfo;                 // CGI_PIPE, CGI_INPUT, CGI_PROCESS (end() once the job is over)
+    pid_t                   pid = -1;                // CGI_PROCESS
+
+    std::unique_ptr<UpstreamHandler> proxy;          // UPSTREAM, owns the socket
+    bool                    keepAlive = false;       // UPSTREAM: the client connection stays open after the response
+    UpstreamPeer            *peer = nullptr;         // UPSTREAM: the server it is connected to
+
+    std::unique_ptr<HealthProbe>    probe;           // HEALTH_CHECK, owns the socket
+};
 
 class WebServer
 {
 public:
-    WebServer(WebParser &parser);
+    WebServer(WebParser &parser, int workerId = 0);
     ~WebServer();
     WebServer(const WebServer &) = delete;
     WebServer &operator=(const WebServer &) = delete;
@@ -48,37 +108,81 @@ public:
     void                 start();
     void                 epollController(int clientSocket, int operation, uint32_t events, FdType fdType);
     int                  getEpollFd() const;
-    cgiInfoList          &getCgiInfoList();
+    void                 registerCgiProcess(const CGIProcessInfo &cgiInfo);
     int                  getCurrentEventFd() const;
 
     static void          setFdNonBlocking(int fd);
+    static void          stop();
 private:
     static volatile sig_atomic_t                s_serverRunning;
     std::vector<ServerSocket>                   _serverSockets = {};
     int                                         _epollFd = -1;
     int                                         _currentEventFd = -1;
+    int                                         _workerId = 0;
     WebParser                                   &_parser;
     std::vector<struct epoll_event>             _events = {};
+    std::vector<char>                           _readBuffer;
+    bool                                        _edgeTriggered = false;
 
-    std::unordered_map<int, std::string>        _partialRequests;
+    std::vector<std::unique_ptr<Connection>>    _connections;
+    TimerWheel                                  _timers;
+    FileCache                                   _fileCache;
+    ResponseCache                               _responseCache;
+    UpstreamPool                                _upstreamPool;
+    UpstreamBalancer                            _balancer;
+    ProxyResolver                               _resolver;
     cgiInfoList                                  _cgiInfoList = {};
-    std::unordered_map<std::string, addrinfo*>  _proxyInfoMap = {};
-    std::unordered_map<int, Request>            _requestMap;
+    std::unordered_map<std::string, std::unique_ptr<CGIPool>>  _cgiPools;   // by cgi_pass script
 
     std::vector<ServerSocket>   createServerSockets(const std::vector<Server> &server_confs);
-    void                        handleClient(int clientSocket);
     void                        handleEvents(int eventCount);
     void                        acceptAddClientToEpoll(int serverSocketFd);
-    void                        resolveProxyAddresses(const std::vector<Server>& server_confs);
 
     void                        handleCGIinteraction(int pipeFd); // read() && send() for CGI
     void                        handleIncomingData(int clientSocket); // recv()
     void                        handleOutgoingData(int clientSocket); // send()
-    void                        CGITimeoutChecker(void);
+    void                        handleTimeouts(void);
+    void                        handleCGITimeout(int pipeFd);
+    Connection                  &watchCgiFd(cgiInfoList::iterator it, int fd, FdType fdType, uint32_t events);
+    void                        watchCgiProcess(cgiInfoList::iterator it);
+    void                        handleCGIExit(int pidFd);
+    void                        writeCgiInput(cgiInfoList::iterator it);
+    void                        closeCgiInput(cgiInfoList::iterator it);
+    void                        forwardCgiOutput(CGIProcessInfo &cgiInfo, Connection &client);
+    void                        resumeCgi(Connection &client);
+    void                        completeCgi(cgiInfoList::iterator it);
+    void                        abortCgi(cgiInfoList::iterator it, int errorCode, bool killScript);
+    void                        stopCgi(cgiInfoList::iterator it, bool killScript);
+    bool                        startPooledCgi(Connection &client, CGIPool &pool);
+    void                        releaseCgiWorker(cgiInfoList::iterator it, bool replace);
+    void                        handleUpstreamEvent(int upstreamSocket, uint32_t events);
+    void                        handleProxyTimeout(int upstreamSocket);
+    void                        forwardProxyResponse(Connection &upstream, Connection &client);
+    void                        finishProxy(Connection &upstream, Connection &client);
+    void                        abortProxy(int upstreamSocket, int errorCode);
+    void                        resumeUpstream(Connection &client);
+    void                        detachUpstream(Connection &client, bool peerFailed);
+    size_t                      proxyTryLimit(const std::string &target) const;
+    void                        startHealthChecks(std::chrono::steady_clock::time_point now);
+    void                        handleHealthCheckEvent(int probeSocket, uint32_t events);
+    void                        finishHealthCheck(int probeSocket, bool healthy);
+    void                        handleClientTimeout(int clientSocket, TimerType type);
     void                        cleanupClient(int clientSocket);
-    void                        processRequest(int clientSocket, const std::string &requestStr);
-    bool                        isRequestComplete(const std::string &request);
-    std::string                 extractCompleteRequest(const std::string &buffer);
+    const Server                *findBodyLimitServer(const Connection &client) const;
+    void                        parseRequests(Connection &client);
+    void                        serveRequests(Connection &client);
+    bool                        startCgi(Connection &client);
+    bool                        startProxy(Connection &client);
+    void                        watchConnection(Connection &connection, uint32_t events);
+    bool                        shouldKeepAlive(const Connection &client, const Request &request, const std::string &response) const;
+    void                        queueResponse(Connection &client, std::string response, bool keepAlive, ResponseBody body = {});
+    void                        endResponse(Connection &client, bool keepAlive);
+    void                        finishClientResponse(Connection &client);
+    Connection                  *getConnection(int fd, FdType fdType) const;
+    Connection                  &addConnection(int fd, FdType fdType);
+    void                        removeConnection(int fd);
 
     static void                 signalHandler(int signal);
+    static std::string          getResponseHeader(const std::string &response, const std::string &name);
+    static void                 setConnectionHeader(std::string &response, bool keepAlive);
 };
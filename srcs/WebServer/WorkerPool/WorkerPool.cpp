@@ -0,0 +1,91 @@
+#include "WorkerPool.hpp"
+#include "WebServer.hpp"
+#include "WebErrors.hpp"
+#include <pthread.h>
+#include <sched.h>
+
+cpu_set_t   WorkerPool::_processCpus;
+bool        WorkerPool::_processCpusKnown = false;
+
+WorkerPool::WorkerPool(WebParser &parser)
+    : _parser(parser), _workerCount(parser.getWorkerThreads()), _pinWorkers(parser.getWorkerCpuAffinity())
+{
+    _processCpusKnown = sched_getaffinity(0, sizeof(_processCpus), &_processCpus) == 0;
+}
+
+void WorkerPool::run()
+{
+    if (_workerCount <= 1) // a single worker has nothing to be kept apart from, it is not pinned
+    {
+        WebServer server(_parser);
+        server.start();
+        return;
+    }
+    try
+    {
+        for (int workerId = 0; workerId < _workerCount; ++workerId)
+            _threads.emplace_back(&WorkerPool::workerRoutine, this, workerId);
+    }
+    catch (const std::exception &e)
+    {
+        std::lock_guard<std::mutex> lock(_errorMutex);
+        if (!_firstError)
+            _firstError = std::current_exception();
+        WebServer::stop();
+    }
+    for (auto &thread : _threads)
+        thread.join();
+    if (_firstError)
+        std::rethrow_exception(_firstError);
+}
+
+// A worker failing to start (e.g. bind error) takes the whole pool down with it
+void WorkerPool::workerRoutine(int workerId)
+{
+    try
+    {
+        if (_pinWorkers)
+            pinToCpu(workerId);
+        WebServer server(_parser, workerId);
+        server.start();
+    }
+    catch (const std::exception &e)
+    {
+        std::lock_guard<std::mutex> lock(_errorMutex);
+        if (!_firstError)
+            _firstError = std::current_exception();
+        WebServer::stop();
+    }
+}
+
+/* Workers are spread over the cores the process may run on (taskset, cpusets, containers), in order */
+void WorkerPool::pinToCpu(int workerId)
+{
+    const int   cpuCount = _processCpusKnown ? CPU_COUNT(&_processCpus) : 0;
+    cpu_set_t   cpuSet;
+
+    if (cpuCount == 0)
+    {
+        WebErrors::printerror("WorkerPool::pinToCpu", "Failed to find the cpus worker " + std::to_string(workerId) + " may run on");
+        return;
+    }
+    CPU_ZERO(&cpuSet);
+    for (int cpu = 0, seen = 0; cpu < CPU_SETSIZE; ++cpu)
+    {
+        if (CPU_ISSET(cpu, &_processCpus) && seen++ == workerId % cpuCount)
+        {
+            CPU_SET(cpu, &cpuSet);
+            break;
+        }
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet) != 0)
+        WebErrors::printerror("WorkerPool::pinToCpu", "Failed to pin worker " + std::to_string(workerId) + " to a cpu");
+}
+
+/* Processes started by a pinned worker (CGI scripts, cgi_pool workers) inherit its core, they get back every core
+   the server could use */
+void WorkerPool::releaseCpu(pid_t pid)
+{
+    if (_processCpusKnown)
+        sched_setaffinity(pid, sizeof(_processCpus), &_processCpus);
+}
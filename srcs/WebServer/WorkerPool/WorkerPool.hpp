@@ -0,0 +1,36 @@
+#pragma once
+
+#include "WebParser.hpp"
+#include <exception>
+#include <mutex>
+#include <sched.h>
+#include <thread>
+#include <vector>
+
+/* Runs one independent WebServer (own epoll, listening sockets, connection and CGI tables) per worker thread */
+class WorkerPool
+{
+public:
+    WorkerPool(WebParser &parser);
+    ~WorkerPool() = default;
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    void        run();
+
+    static void releaseCpu(pid_t pid);
+
+private:
+    WebParser                   &_parser;
+    int                         _workerCount;
+    bool                        _pinWorkers;
+    std::vector<std::thread>    _threads;
+    std::exception_ptr          _firstError = nullptr;
+    std::mutex                  _errorMutex;
+
+    static cpu_set_t            _processCpus;   // what the process could run on before any worker was pinned
+    static bool                 _processCpusKnown;
+
+    void    workerRoutine(int workerId);
+    void    pinToCpu(int workerId);
+};
@@ -2,6 +2,7 @@
 #include "WebErrors.hpp"
 #include <fstream>
 #include "WebParser/WebParser.hpp"
+#include "WorkerPool.hpp"
 
 int main(int ac, char **av)
 {
@@ -12,8 +13,8 @@ int main(int ac, char **av)
             WebParser parser(av[1]);
             parser.parse();
 
-            WebServer server(parser);
-            server.start();
+            WorkerPool workers(parser);
+            workers.run();
         }
         catch (std::exception &e)
         {